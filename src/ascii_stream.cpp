@@ -0,0 +1,254 @@
+#include "ascii_stream.h"
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "image_functions.h"
+using namespace std;
+
+
+constexpr int MAX_HEADER_LENGTH = 1024;	// Longest accepted Y4M stream or frame header
+constexpr double DEFAULT_FPS = 30.0;	// Playback rate of streams that do not carry one
+
+const char Y4M_MAGIC[] = "YUV4MPEG2";	// Signature at the start of a Y4M stream
+const char CLEAR_SCREEN[] = "\x1b[2J\x1b[?25l";	// Clears the terminal and hides the cursor
+const char CURSOR_HOME[] = "\x1b[H";	// Moves the cursor to the top left corner
+const char SHOW_CURSOR[] = "\x1b[?25h";	// Shows the cursor again
+
+
+namespace {
+
+volatile sig_atomic_t interrupted = 0;	// Set when the user asks to stop the stream
+
+
+/**
+ * Describes the layout of the frames in an input stream
+ */
+struct StreamFormat {
+	bool y4m = false;	// Whether the stream is Y4M (otherwise raw rgb24)
+	int width = 0;	// The width of a frame
+	int height = 0;	// The height of a frame
+	int bpp = 3;	// Bytes per pixel of the plane that is rendered
+	double fps = 0;	// The frame rate declared by the stream, if any
+	size_t skip_bytes = 0;	// Bytes following the rendered plane in each frame (Y4M chroma)
+};
+
+
+void on_interrupt(int) {
+	interrupted = 1;
+}
+
+
+/**
+ * Reads a header line, without the trailing newline
+ * @param in The input stream
+ * @param line Overridden with the line
+ * @param prefix Bytes of the line that have already been read
+ * @return Whether a complete line was read
+ */
+bool read_line(FILE* in, string& line, const string& prefix) {
+	line = prefix;
+	int c;
+	while ((c = fgetc(in)) != EOF && c != '\n') {
+		if (line.size() >= static_cast<size_t>(MAX_HEADER_LENGTH)) {
+			return false;
+		}
+		line += static_cast<char>(c);
+	}
+	return c == '\n';
+}
+
+
+/**
+ * Parses the header of a Y4M stream
+ * @param header The header line
+ * @param format Overridden with the frame layout
+ * @return Whether the stream can be rendered
+ */
+bool parse_y4m_header(const string& header, StreamFormat& format) {
+	string colorspace = "420jpeg";
+	size_t pos = strlen(Y4M_MAGIC);
+	while (pos < header.size()) {
+		const size_t end = min(header.find(' ', pos + 1), header.size());
+		const string token = header.substr(pos + 1, end - pos - 1);
+		pos = end;
+		if (token.empty()) {
+			continue;
+		}
+		const string value = token.substr(1);
+		switch (token[0]) {
+			case 'W':
+				format.width = atoi(value.c_str());
+				break;
+			case 'H':
+				format.height = atoi(value.c_str());
+				break;
+			case 'F': {
+				const int num = atoi(value.c_str());
+				const size_t colon = value.find(':');
+				const int den = colon == string::npos ? 1 : atoi(value.c_str() + colon + 1);
+				if (num > 0 && den > 0) {
+					format.fps = static_cast<double>(num) / den;
+				}
+				break;
+			}
+			case 'C':
+				colorspace = value;
+				break;
+			default:
+				break;
+		}
+	}
+	if (format.width <= 0 || format.height <= 0) {
+		return false;
+	}
+
+	// Only the luma plane is rendered; everything after it in a frame is skipped
+	const size_t w = format.width;
+	const size_t h = format.height;
+	const size_t half_w = (w + 1) / 2;
+	if (colorspace.compare(0, 3, "420") == 0 && colorspace.find("p1") == string::npos) {
+		format.skip_bytes = 2 * half_w * ((h + 1) / 2);
+	}
+	else if (colorspace == "422") {
+		format.skip_bytes = 2 * half_w * h;
+	}
+	else if (colorspace == "411") {
+		format.skip_bytes = 2 * ((w + 3) / 4) * h;
+	}
+	else if (colorspace == "444") {
+		format.skip_bytes = 2 * w * h;
+	}
+	else if (colorspace == "444alpha") {
+		format.skip_bytes = 3 * w * h;
+	}
+	else if (colorspace == "mono") {
+		format.skip_bytes = 0;
+	}
+	else {
+		cerr << "Unsupported Y4M colorspace: " << colorspace << endl;
+		return false;
+	}
+	format.y4m = true;
+	format.bpp = 1;
+	return true;
+}
+
+
+/**
+ * Reads exactly the given number of bytes
+ * @return Whether all bytes were read
+ */
+bool read_fully(FILE* in, uint8_t* buffer, const size_t& count) {
+	return fread(buffer, 1, count, in) == count;
+}
+
+}
+
+
+int ascii_stream(FILE* in, FILE* out, const AsciiStreamOptions& options) {
+#ifdef _WIN32
+	_setmode(_fileno(in), _O_BINARY);
+#endif
+	StreamFormat format;
+	string line;
+
+	// Detect the stream type from its first bytes
+	char magic[sizeof(Y4M_MAGIC) - 1];
+	const size_t magic_length = fread(magic, 1, sizeof(magic), in);
+	if (magic_length == sizeof(magic) && memcmp(magic, Y4M_MAGIC, sizeof(magic)) == 0) {
+		if (!read_line(in, line, Y4M_MAGIC) || !parse_y4m_header(line, format)) {
+			cerr << "Invalid Y4M stream header." << endl;
+			return 2;
+		}
+	}
+	else {
+		if (options.width <= 0 || options.height <= 0) {
+			cerr << "Raw rgb24 input requires --width and --height." << endl;
+			return 2;
+		}
+		format.width = options.width;
+		format.height = options.height;
+	}
+
+	// Allocate every buffer once; they are reused for each frame
+	const size_t frame_bytes = static_cast<size_t>(format.width) * format.height * format.bpp;
+	vector<uint8_t> frame(frame_bytes);
+	vector<uint8_t> skipped(format.skip_bytes);
+	AsciiRenderer renderer(format.width, format.height, options.cols, options.ratio);
+	char status[128];
+
+	// Bytes consumed while detecting a raw stream belong to its first frames; frames smaller
+	// than the detection read take them a frame at a time
+	size_t detected = format.y4m ? 0 : magic_length;
+	const char* detected_bytes = magic;
+
+	// Determine the playback rate
+	double fps = options.fps > 0 ? options.fps : format.fps > 0 ? format.fps : DEFAULT_FPS;
+	typedef chrono::steady_clock Clock;
+	const Clock::duration interval = chrono::duration_cast<Clock::duration>(chrono::duration<double>(1.0 / fps));
+	Clock::time_point start;
+
+	signal(SIGINT, on_interrupt);
+	fputs(CLEAR_SCREEN, out);
+
+	long frames = 0;
+	long dropped = 0;
+	while (!interrupted) {
+		// Read the next frame
+		if (format.y4m) {
+			if (!read_line(in, line, "") || line.compare(0, 5, "FRAME") != 0) {
+				break;
+			}
+		}
+		const size_t prefilled = min(detected, frame_bytes);
+		memcpy(frame.data(), detected_bytes, prefilled);
+		detected -= prefilled;
+		detected_bytes += prefilled;
+		if (!read_fully(in, frame.data() + prefilled, frame_bytes - prefilled)
+			|| !read_fully(in, skipped.data(), format.skip_bytes)) {
+			break;
+		}
+
+		// Skip the frame if it is already due to be replaced by the next one
+		if (frames == 0) {
+			start = Clock::now();
+		}
+		const Clock::time_point due = start + interval * frames;
+		frames++;
+		if (options.paced && Clock::now() > due + interval) {
+			dropped++;
+			continue;
+		}
+
+		// Draw the frame over the previous one
+		const string& ascii_str = renderer.render(&frame[0], format.width * format.bpp, format.bpp);
+		const int status_length = snprintf(status, sizeof(status),
+			"frame %ld | dropped %ld\n", frames, dropped);
+		if (options.paced) {
+			this_thread::sleep_until(due);
+		}
+		fputs(CURSOR_HOME, out);
+		fwrite(ascii_str.data(), 1, ascii_str.size(), out);
+		fwrite(status, 1, status_length, out);
+		fflush(out);
+	}
+
+	fputs(SHOW_CURSOR, out);
+	fflush(out);
+	cerr << "Rendered " << frames - dropped << " of " << frames << " frames";
+	if (dropped > 0) {
+		cerr << " (dropped " << dropped << " to keep up with " << fps << " fps)";
+	}
+	cerr << endl;
+	return 0;
+}
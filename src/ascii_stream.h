@@ -0,0 +1,32 @@
+#ifndef ASCII_STREAM_H
+#define ASCII_STREAM_H
+
+#include <string>
+#include <cstdio>
+
+/**
+ * Options for rendering a stream of raw frames as ASCII art
+*/
+struct AsciiStreamOptions {
+	int width = 0;	// The width of raw rgb24 frames (Y4M streams carry their own size)
+	int height = 0;	// The height of raw rgb24 frames
+	int cols = 80;	// The number of characters along the width
+	double ratio = 2.0;	// The width/height ratio to stretch the frames by
+	double fps = 0;	// Playback rate; 0 uses the rate of the stream (or 30 for raw frames)
+	bool paced = true;	// Whether to play back in real time, dropping frames when falling behind
+};
+
+
+/**
+ * Reads raw frames from a stream and redraws each one on the terminal as ASCII art.
+ * The input is either a YUV4MPEG2 (Y4M) stream, whose luma plane is used directly,
+ * or headerless rgb24 frames of the size given in the options.
+ * @param in The input stream
+ * @param out The output stream, usually the terminal
+ * @param options The rendering options
+ * @return Exit code
+ */
+int ascii_stream(std::FILE* in, std::FILE* out, const AsciiStreamOptions& options);
+
+
+#endif
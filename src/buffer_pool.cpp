@@ -0,0 +1,175 @@
+#include "buffer_pool.h"
+#include "util.h"
+#include <cstdlib>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+using namespace std;
+
+
+constexpr size_t POOL_MIN_BYTES = 64 * 1024;	// Smallest block kept for reuse; smaller ones come from the heap
+constexpr size_t DEFAULT_POOL_LIMIT = size_t(1) << 30;	// Bytes of released blocks kept unless set otherwise
+constexpr size_t PAGE_SIZE = 4096;	// Alignment of pooled blocks
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;	// Alignment of pooled blocks backed by huge pages
+
+
+namespace {
+
+/**
+ * Stored right in front of every block
+ */
+struct BlockHeader {
+	size_t offset;	// How far the block is from the start of its allocation
+	size_t capacity;	// The size class of a pooled block, or 0 for a block from the heap
+};
+
+
+/**
+ * Finds the size class of a block
+ * @param size The bytes the block needs, including its header
+ * @return The capacity of the size class, a multiple of an eighth of the next power of two
+ */
+size_t size_class(const size_t& size) {
+	size_t power = 1;
+	while (power < size) {
+		power <<= 1;
+	}
+	const size_t step = power / 8;
+	return (size + step - 1) / step * step;
+}
+
+
+/**
+ * Returns the header of a block
+ * @param data The block
+ * @return The header
+ */
+BlockHeader& header(uint8_t* data) {
+	return *reinterpret_cast<BlockHeader*>(data - sizeof(BlockHeader));
+}
+
+
+/**
+ * Returns a pooled block to the system
+ * @param data The block
+ */
+void free_block(uint8_t* data) {
+	uint8_t* allocation = data - header(data).offset;
+#ifdef __linux__
+	free(allocation);
+#else
+	delete[] allocation;
+#endif
+}
+
+}
+
+
+BufferPool::BufferPool(const size_t& limit) : kept_bytes(0), limit(limit), huge_pages(false) {
+}
+
+
+BufferPool::~BufferPool() {
+	for (auto& blocks : free_blocks) {
+		for (uint8_t* data : blocks.second) {
+			free_block(data);
+		}
+	}
+}
+
+
+uint8_t* BufferPool::allocate_block(const size_t& capacity) const {
+#ifdef __linux__
+	// Blocks start on a page so the system can back them with whole pages; the first
+	// ROW_ALIGNMENT bytes hold the header
+	const size_t alignment = huge_pages && capacity >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+	void* allocation = nullptr;
+	if (posix_memalign(&allocation, alignment, capacity) != 0) {
+		throw bad_alloc();
+	}
+	if (alignment == HUGE_PAGE_SIZE) {
+		madvise(allocation, capacity, MADV_HUGEPAGE);
+	}
+	auto* data = static_cast<uint8_t*>(allocation) + ROW_ALIGNMENT;
+#else
+	auto* allocation = new uint8_t[capacity + ROW_ALIGNMENT];
+	uint8_t* data = allocation + 2 * ROW_ALIGNMENT - reinterpret_cast<uintptr_t>(allocation) % ROW_ALIGNMENT;
+#endif
+	header(data) = BlockHeader{static_cast<size_t>(data - static_cast<uint8_t*>(allocation)), capacity};
+	return data;
+}
+
+
+uint8_t* BufferPool::take(const size_t& size) {
+	if (size + ROW_ALIGNMENT < POOL_MIN_BYTES) {
+		auto* allocation = new uint8_t[size + 2 * ROW_ALIGNMENT];
+		uint8_t* data = allocation + 2 * ROW_ALIGNMENT - reinterpret_cast<uintptr_t>(allocation) % ROW_ALIGNMENT;
+		header(data) = BlockHeader{static_cast<size_t>(data - allocation), 0};
+		return data;
+	}
+	const size_t capacity = size_class(size + ROW_ALIGNMENT);
+	{
+		lock_guard<std::mutex> lock(mutex);
+		// The smallest released block that fits, unless it would waste more than it holds
+		for (auto found = free_blocks.lower_bound(capacity);
+			found != free_blocks.end() && found->first <= 2 * capacity; ++found) {
+			if (!found->second.empty()) {
+				uint8_t* data = found->second.back();
+				found->second.pop_back();
+				kept_bytes -= found->first;
+				return data;
+			}
+		}
+	}
+	return allocate_block(capacity);
+}
+
+
+void BufferPool::give(uint8_t* data) {
+	const size_t capacity = header(data).capacity;
+	if (capacity == 0) {
+		delete[] (data - header(data).offset);
+		return;
+	}
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (kept_bytes + capacity <= limit) {
+			free_blocks[capacity].push_back(data);
+			kept_bytes += capacity;
+			return;
+		}
+	}
+	free_block(data);
+}
+
+
+void BufferPool::setLimit(const size_t& bytes) {
+	vector<uint8_t*> freed;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		limit = bytes;
+		// The largest blocks go first, as they are the least likely to be asked for again
+		for (auto blocks = free_blocks.rbegin(); blocks != free_blocks.rend() && kept_bytes > limit; ++blocks) {
+			while (!blocks->second.empty() && kept_bytes > limit) {
+				freed.push_back(blocks->second.back());
+				blocks->second.pop_back();
+				kept_bytes -= blocks->first;
+			}
+		}
+	}
+	for (uint8_t* data : freed) {
+		free_block(data);
+	}
+}
+
+
+void BufferPool::setHugePages(const bool& enabled) {
+	huge_pages = enabled;
+}
+
+
+BufferPool& shared_buffer_pool() {
+	static BufferPool pool(DEFAULT_POOL_LIMIT);
+	return pool;
+}
@@ -0,0 +1,82 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * Keeps released blocks of memory for reuse, so the large buffers of images are not
+ * returned to the system and page-faulted in again by the next operation. Sizes are
+ * rounded up to size classes four to each power of two, and a released block serves the
+ * next request it fits without wasting more than half of it. Small blocks come from the
+ * heap as usual.
+*/
+class BufferPool {
+	std::mutex mutex;	// Guards the state below
+	std::map<std::size_t, std::vector<std::uint8_t*>> free_blocks;	// Released blocks by capacity
+	std::size_t kept_bytes;	// The total capacity of the released blocks
+	std::size_t limit;	// The most bytes of released blocks to keep
+	bool huge_pages;	// Whether new blocks ask the system for huge pages
+
+	/**
+	 * Gets a new block from the system
+	 * @param capacity The size of the block in bytes
+	 * @return The block
+	 */
+	std::uint8_t* allocate_block(const std::size_t& capacity) const;
+
+public:
+	/**
+	 * Creates an empty pool
+	 * @param limit The most bytes of released blocks to keep
+	 */
+	explicit BufferPool(const std::size_t& limit);
+
+	BufferPool(const BufferPool& pool) = delete;
+	BufferPool& operator=(const BufferPool& pool) = delete;
+
+	/**
+	 * Frees every released block
+	 */
+	~BufferPool();
+
+	/**
+	 * Takes a block, reusing the smallest released one that fits and is at most twice the
+	 * size class
+	 * @param size The size of the block in bytes
+	 * @return The block, aligned to ROW_ALIGNMENT bytes; its contents are undefined
+	 */
+	std::uint8_t* take(const std::size_t& size);
+
+	/**
+	 * Gives back a block for reuse, or frees it if the pool is full
+	 * @param data The block, as returned by take
+	 */
+	void give(std::uint8_t* data);
+
+	/**
+	 * Sets how many bytes of released blocks to keep, freeing blocks over the new limit
+	 * @param bytes The limit in bytes; 0 frees every block as it is released
+	 */
+	void setLimit(const std::size_t& bytes);
+
+	/**
+	 * Sets whether blocks allocated afterwards ask for transparent huge pages, which
+	 * take fewer page faults and TLB entries. Only Linux supports it.
+	 * @param enabled Whether to ask for huge pages
+	 */
+	void setHugePages(const bool& enabled);
+};
+
+
+/**
+ * Returns the pool that allocate_aligned takes image buffers from
+ * @return The pool, shared by every thread
+*/
+BufferPool& shared_buffer_pool();
+
+
+#endif
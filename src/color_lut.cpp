@@ -0,0 +1,344 @@
+#include "color_lut.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "parallel.h"
+using namespace std;
+
+
+constexpr int MAX_LUT_1D_SIZE = 65536;	// Largest accepted number of points of a curve
+constexpr int MAX_LUT_3D_SIZE = 256;	// Largest accepted number of grid points along an axis
+
+
+namespace {
+
+/**
+ * Finds the grid cell of a value of a channel and its position inside the cell
+ * @param lut The lookup table
+ * @param channel The channel
+ * @param stride Distance in table entries between two grid points along the channel's axis
+ * @param value The value, where 1 is full intensity
+ * @param offset Overridden with the offset of the lower grid point
+ * @param fraction Overridden with the position between the lower and upper grid point
+ */
+inline void grid_position(const ColorLut& lut, const int& channel, const int& stride, const double& value,
+	int& offset, float& fraction) {
+	const double range = lut.domain_max[channel] - lut.domain_min[channel];
+	double position = (value - lut.domain_min[channel]) / range * (lut.size - 1);
+	position = min(static_cast<double>(lut.size - 1), max(0.0, position));
+	// The last grid point is reached from the cell below it, so the upper point always exists
+	const int lower = min(lut.size - 2, static_cast<int>(position));
+	offset = lower * stride;
+	fraction = static_cast<float>(position - lower);
+}
+
+
+/**
+ * Finds the grid cell and position inside it of every 8-bit value of a channel
+ * @param lut The lookup table
+ * @param channel The channel
+ * @param stride Distance in table entries between two grid points along the channel's axis
+ * @param offsets Overridden with the offset of the lower grid point for each value
+ * @param fractions Overridden with the position between the lower and upper grid point
+ */
+void grid_positions(const ColorLut& lut, const int& channel, const int& stride, int offsets[256], float fractions[256]) {
+	for (int value = 0; value < 256; value++) {
+		grid_position(lut, channel, stride, value / 255.0, offsets[value], fractions[value]);
+	}
+}
+
+
+/**
+ * Converts an output value of a table to a byte
+ */
+inline uint8_t to_byte(const float& value) {
+	return clamp_round(value * 255.0);
+}
+
+
+/**
+ * Samples a 3D table at one color
+ * @param table The table, at the lower corner of the cell holding the color
+ * @param g_stride Distance in table entries between two grid points along green
+ * @param b_stride Distance in table entries between two grid points along blue
+ * @param fr Position of the color inside the cell along red
+ * @param fg Position of the color inside the cell along green
+ * @param fb Position of the color inside the cell along blue
+ * @param interpolation The interpolation
+ * @param out Overridden with the output color
+ */
+inline void sample_cube(const float* table, const int& g_stride, const int& b_stride,
+	const float& fr, const float& fg, const float& fb, const LutInterpolation& interpolation, float out[3]) {
+	// Corners are named by their red, green and blue bit
+	const float* c000 = table;
+	const float* c100 = table + 3;
+	const float* c010 = table + g_stride;
+	const float* c110 = table + g_stride + 3;
+	const float* c001 = table + b_stride;
+	const float* c101 = table + b_stride + 3;
+	const float* c011 = table + b_stride + g_stride;
+	const float* c111 = table + b_stride + g_stride + 3;
+	if (interpolation == LutInterpolation::TRILINEAR) {
+		for (int c = 0; c < 3; c++) {
+			const float c00 = c000[c] + (c100[c] - c000[c]) * fr;
+			const float c10 = c010[c] + (c110[c] - c010[c]) * fr;
+			const float c01 = c001[c] + (c101[c] - c001[c]) * fr;
+			const float c11 = c011[c] + (c111[c] - c011[c]) * fr;
+			const float c0 = c00 + (c10 - c00) * fg;
+			const float c1 = c01 + (c11 - c01) * fg;
+			out[c] = c0 + (c1 - c0) * fb;
+		}
+		return;
+	}
+	// The cube splits into six tetrahedra along its diagonal; the order of the fractions
+	// picks the one holding the color, and the weights are the differences between them
+	const float *a, *b;
+	float w0, w1, w2, w3;
+	if (fr > fg) {
+		if (fg > fb) {
+			a = c100; b = c110; w0 = 1 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+		}
+		else if (fr > fb) {
+			a = c100; b = c101; w0 = 1 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+		}
+		else {
+			a = c001; b = c101; w0 = 1 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+		}
+	}
+	else {
+		if (fb > fg) {
+			a = c001; b = c011; w0 = 1 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+		}
+		else if (fb > fr) {
+			a = c010; b = c011; w0 = 1 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+		}
+		else {
+			a = c010; b = c110; w0 = 1 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		out[c] = w0 * c000[c] + w1 * a[c] + w2 * b[c] + w3 * c111[c];
+	}
+}
+
+
+/**
+ * Maps the colors of an image with 16-bit or float samples through a lookup table. There
+ * are too many possible values for tables of grid positions, so every sample finds its own.
+ * @param image The image
+ * @param lut The lookup table
+ * @param interpolation Determines how a 3D table is sampled between its grid points
+ * @param strides Distance in grid points between two neighbors along each axis
+ * @return The output image
+ */
+template <typename T>
+ImageMatrix* apply_lut_samples(const ImageMatrix& image, const ColorLut& lut, const LutInterpolation& interpolation,
+	const int strides[3]) {
+	const int width = image.getWidth();
+	const int bpp = image.getBpp();
+	const int channels = color_channels(bpp);
+	const double full = sample_max(image.getSampleType());
+	auto* new_image = new ImageMatrix(width, image.getHeight(), bpp, 0, image.getSampleType());
+	parallel_for(image.getHeight(), [&](const int& i) {
+		const T* row = image.getSamples<T>(i);
+		T* new_row = new_image->getSamples<T>(i);
+		for (int j = 0; j < width * bpp; j += bpp) {
+			// Gray pixels are looked up as equal red, green and blue
+			const T rgb[3] = { row[j], row[j + channels / 3], row[j + 2 * (channels / 3)] };
+			int offsets[3];
+			float fractions[3];
+			for (int c = 0; c < 3; c++) {
+				grid_position(lut, c, 3 * strides[c], rgb[c] / full, offsets[c], fractions[c]);
+			}
+			float color[3];
+			if (lut.three_dimensional) {
+				sample_cube(&lut.table[offsets[0] + offsets[1] + offsets[2]], 3 * strides[1], 3 * strides[2],
+					fractions[0], fractions[1], fractions[2], interpolation, color);
+			}
+			else {
+				for (int c = 0; c < 3; c++) {
+					const float* point = &lut.table[offsets[c] + c];
+					color[c] = point[0] + (point[3] - point[0]) * fractions[c];
+				}
+			}
+			if (channels == 3) {
+				for (int c = 0; c < 3; c++) {
+					new_row[j + c] = to_sample<T>(color[c] * full);
+				}
+			}
+			else {
+				new_row[j] = to_sample<T>((color[0] + color[1] + color[2]) / 3.0 * full);
+			}
+			for (int c = channels; c < bpp; c++) {
+				new_row[j + c] = row[j + c];
+			}
+		}
+	});
+	return new_image;
+}
+
+
+/**
+ * Prints an error about a .cube file and exits
+ */
+void invalid_cube(const string& path, const string& reason) {
+	cout << "Invalid LUT file " << path << ": " << reason << endl;
+	exit(2);
+}
+
+}
+
+
+ColorLut* read_cube(const string& path) {
+	ifstream file(path);
+	if (!file) {
+		cout << "Could not read LUT file: " << path << endl;
+		exit(2);
+	}
+	auto* lut = new ColorLut();
+	string line;
+	while (getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		const size_t start = line.find_first_not_of(" \t\r");
+		if (start == string::npos) {
+			continue;
+		}
+		// Rows of the table make up nearly all of a file, so they skip the stream parser
+		if (isdigit(static_cast<unsigned char>(line[start])) || line[start] == '-' || line[start] == '.') {
+			const char* position = line.c_str() + start;
+			for (int c = 0; c < 3; c++) {
+				char* end;
+				lut->table.push_back(strtof(position, &end));
+				if (end == position) {
+					invalid_cube(path, "malformed row: " + line);
+				}
+				position = end;
+			}
+			continue;
+		}
+		istringstream fields(line);
+		string keyword;
+		fields >> keyword;
+		if (keyword == "TITLE") {
+			continue;
+		}
+		if (keyword == "LUT_1D_SIZE" || keyword == "LUT_3D_SIZE") {
+			lut->three_dimensional = keyword == "LUT_3D_SIZE";
+			const int largest = lut->three_dimensional ? MAX_LUT_3D_SIZE : MAX_LUT_1D_SIZE;
+			if (!(fields >> lut->size) || lut->size < 2 || lut->size > largest) {
+				invalid_cube(path, "unsupported size");
+			}
+		}
+		else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX") {
+			double* domain = keyword == "DOMAIN_MIN" ? lut->domain_min : lut->domain_max;
+			if (!(fields >> domain[0] >> domain[1] >> domain[2])) {
+				invalid_cube(path, "malformed " + keyword);
+			}
+		}
+		else if (keyword == "LUT_1D_INPUT_RANGE" || keyword == "LUT_3D_INPUT_RANGE") {
+			double low, high;
+			if (!(fields >> low >> high)) {
+				invalid_cube(path, "malformed " + keyword);
+			}
+			fill(lut->domain_min, lut->domain_min + 3, low);
+			fill(lut->domain_max, lut->domain_max + 3, high);
+		}
+		else {
+			invalid_cube(path, "unknown keyword " + keyword);
+		}
+	}
+	if (lut->size == 0) {
+		invalid_cube(path, "missing LUT_1D_SIZE or LUT_3D_SIZE");
+	}
+	const size_t entries = lut->three_dimensional
+		? static_cast<size_t>(lut->size) * lut->size * lut->size : static_cast<size_t>(lut->size);
+	if (lut->table.size() != 3 * entries) {
+		invalid_cube(path, "expected " + to_string(entries) + " rows");
+	}
+	for (int c = 0; c < 3; c++) {
+		if (!(lut->domain_max[c] > lut->domain_min[c])) {
+			invalid_cube(path, "empty domain");
+		}
+	}
+	return lut;
+}
+
+
+ImageMatrix* apply_lut(const ImageMatrix& image, const ColorLut& lut, const LutInterpolation& interpolation) {
+	const int width = image.getWidth();
+	const int height = image.getHeight();
+	const int bpp = image.getBpp();
+	const int channels = color_channels(bpp);
+	const int strides[3] = {
+		1,
+		lut.three_dimensional ? lut.size : 1,
+		lut.three_dimensional ? lut.size * lut.size : 1
+	};
+	if (image.getSampleType() == SampleType::U16) {
+		return apply_lut_samples<uint16_t>(image, lut, interpolation, strides);
+	}
+	if (image.getSampleType() == SampleType::F32) {
+		return apply_lut_samples<float>(image, lut, interpolation, strides);
+	}
+	auto* new_image = new ImageMatrix(width, height, bpp);
+
+	// Every input value has one of 256 grid positions per channel, so they are found once
+	int offsets[3][256];
+	float fractions[3][256];
+	for (int c = 0; c < 3; c++) {
+		grid_positions(lut, c, 3 * strides[c], offsets[c], fractions[c]);
+	}
+
+	// Curves only have 256 possible results per channel, so they become byte tables
+	uint8_t curves[3][256];
+	if (!lut.three_dimensional) {
+		for (int c = 0; c < 3; c++) {
+			for (int value = 0; value < 256; value++) {
+				const float* point = &lut.table[offsets[c][value] + c];
+				curves[c][value] = to_byte(point[0] + (point[3] - point[0]) * fractions[c][value]);
+			}
+		}
+	}
+
+	parallel_for(height, [&](const int& i) {
+		const uint8_t* row = image.getRow(i);
+		uint8_t* new_row = new_image->getRow(i);
+		for (int j = 0; j < width * bpp; j += bpp) {
+			// Gray pixels are looked up as equal red, green and blue
+			const uint8_t r = row[j];
+			const uint8_t g = row[j + channels / 3];
+			const uint8_t b = row[j + 2 * (channels / 3)];
+			uint8_t out[3];
+			if (lut.three_dimensional) {
+				float color[3];
+				sample_cube(&lut.table[offsets[0][r] + offsets[1][g] + offsets[2][b]], 3 * strides[1], 3 * strides[2],
+					fractions[0][r], fractions[1][g], fractions[2][b], interpolation, color);
+				for (int c = 0; c < 3; c++) {
+					out[c] = to_byte(color[c]);
+				}
+			}
+			else {
+				out[0] = curves[0][r];
+				out[1] = curves[1][g];
+				out[2] = curves[2][b];
+			}
+			if (channels == 3) {
+				new_row[j] = out[0];
+				new_row[j + 1] = out[1];
+				new_row[j + 2] = out[2];
+			}
+			else {
+				new_row[j] = static_cast<uint8_t>((out[0] + out[1] + out[2] + 1) / 3);
+			}
+			for (int c = channels; c < bpp; c++) {
+				new_row[j + c] = row[j + c];
+			}
+		}
+	});
+	return new_image;
+}
@@ -0,0 +1,50 @@
+#ifndef COLOR_LUT_H
+#define COLOR_LUT_H
+
+#include <string>
+#include <vector>
+#include "util.h"
+
+/**
+ * Determines how a 3D lookup table is sampled between its grid points
+*/
+enum class LutInterpolation {
+	TRILINEAR,	// Blends the eight corners of the surrounding cube
+	TETRAHEDRAL	// Blends the four corners of the tetrahedron around the color
+};
+
+
+/**
+ * A color lookup table, either one curve per channel (1D) or a cube of output colors
+ * indexed by the input color (3D). Input colors are scaled from the domain of the
+ * table to grid coordinates; output colors are nominally in [0, 1].
+*/
+struct ColorLut {
+	bool three_dimensional = false;	// Whether the table is a 3D cube instead of three curves
+	int size = 0;	// Number of grid points along each axis
+	double domain_min[3] = {0.0, 0.0, 0.0};	// Input color of the first grid point
+	double domain_max[3] = {1.0, 1.0, 1.0};	// Input color of the last grid point
+	std::vector<float> table;	// RGB triples; red varies fastest, then green, then blue
+};
+
+
+/**
+ * Reads a lookup table in the .cube format (LUT_1D_SIZE or LUT_3D_SIZE)
+ * @param path The path of the .cube file
+ * @return The lookup table
+*/
+ColorLut* read_cube(const std::string& path);
+
+
+/**
+ * Maps the colors of an image through a lookup table. Channels after the first three
+ * are copied, and single-channel images are looked up as gray.
+ * @param image The image
+ * @param lut The lookup table
+ * @param interpolation Determines how a 3D table is sampled between its grid points
+ * @return The output image
+*/
+ImageMatrix* apply_lut(const ImageMatrix& image, const ColorLut& lut, const LutInterpolation& interpolation);
+
+
+#endif
@@ -0,0 +1,892 @@
+#include "convolution.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <sstream>
+#include "fft.h"
+#include "parallel.h"
+using namespace std;
+
+
+constexpr size_t MIN_TILE_HEIGHT = 8;	// Fewest rows in a convolution tile
+constexpr double SEPARABLE_TOLERANCE = 1e-9;	// Largest relative error of a separated kernel
+constexpr double FIXED_POINT_TOLERANCE = 1.0 / 64;	// Largest rounding error of fixed-point weights, in levels
+constexpr int MAX_WEIGHT_SHIFT = 30;	// Most fractional bits of a fixed-point weight
+constexpr int MAX_MULTIPLIER_SHIFT = 40;	// Most fractional bits of a fixed-point multiplier
+constexpr int64_t MAX_PIXEL = 255;	// Largest value of an 8-bit pixel
+constexpr int FFT_MIN_SIZE = 64;	// Smallest transform used for a block
+constexpr int FFT_BLOCK_FACTOR = 4;	// Transform size relative to the kernel size
+constexpr int MAX_SVD_SWEEPS = 30;	// Most Jacobi sweeps of a singular value decomposition
+constexpr double SVD_EPSILON = 1e-15;	// Largest cosine between two columns considered orthogonal
+constexpr double FIXED_POINT_COST = 0.8;	// Cost of a fixed-point tap relative to a floating-point tap
+constexpr double FFT_COST_FACTOR = 11.0;	// Cost of an FFT pass per transformed value relative to a tap
+
+
+typedef complex<double> Complex;
+
+
+namespace {
+
+/**
+ * Scales a fixed-point total and rounds it to a byte
+ * @param total The weighted sum
+ * @param multiplier The multiplier of the kernel
+ * @param shift The shift of the kernel
+ * @return The byte value
+ */
+inline uint8_t fixed_round(const int64_t& total, const int64_t& multiplier, const int& shift) {
+	const int64_t value = total * multiplier;
+	if (value <= 0) {
+		return 0;
+	}
+	const int64_t rounded = shift > 0 ? (value + (static_cast<int64_t>(1) << (shift - 1))) >> shift : value;
+	return static_cast<uint8_t>(min(MAX_PIXEL, rounded));
+}
+
+
+/**
+ * Converts integer-valued weights to 16 bits
+ * @param values The weights
+ * @param count The number of weights
+ * @param weights Overridden with the 16-bit weights
+ * @return Whether every weight is an integer that fits in 16 bits
+ */
+bool integer_weights(const double* values, const size_t& count, vector<int16_t>& weights) {
+	weights.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		if (values[i] != floor(values[i]) || fabs(values[i]) > INT16_MAX) {
+			return false;
+		}
+		weights[i] = static_cast<int16_t>(values[i]);
+	}
+	return true;
+}
+
+
+/**
+ * Returns the sum of the absolute values of fixed-point weights
+ */
+int64_t weight_sum(const vector<int16_t>& weights) {
+	int64_t sum = 0;
+	for (const int16_t weight : weights) {
+		sum += abs(static_cast<int>(weight));
+	}
+	return sum;
+}
+
+
+/**
+ * Turns a scalar into the multiplier and shift of a fixed-point kernel, with as many
+ * fractional bits as keep the multiplier within 32 bits, so its product with a
+ * 32-bit total fits in 64 bits
+ * @param scalar The scalar
+ * @param fixed The kernel whose multiplier and shift are overridden
+ */
+void set_multiplier(const double& scalar, FixedPointKernel& fixed) {
+	int shift = 0;
+	while (shift < MAX_MULTIPLIER_SHIFT && fabs(scalar) * ldexp(1.0, shift + 1) <= INT32_MAX) {
+		shift++;
+	}
+	fixed.shift = shift;
+	fixed.multiplier = llround(scalar * ldexp(1.0, shift));
+}
+
+
+/**
+ * Picks the transform size along one axis of an FFT convolution of a large image. Blocks
+ * several times the kernel size keep the transform cost per output pixel low.
+ * @param kernel_rows The width and height of the kernel
+ * @return The transform size
+ */
+int fft_target_size(const int& kernel_rows) {
+	return FFT::good_size(max(FFT_MIN_SIZE, FFT_BLOCK_FACTOR * (kernel_rows - 1)));
+}
+
+
+/**
+ * Picks the transform size along one axis of an FFT convolution
+ * @param kernel_rows The width and height of the kernel
+ * @param domain The size of the padded input along the axis
+ * @return The transform size
+ */
+int fft_block_size(const int& kernel_rows, const int& domain) {
+	// There is no point in transforming more than the whole input at once
+	const int whole = FFT::good_size(domain + kernel_rows - 1);
+	return min(fft_target_size(kernel_rows), whole);
+}
+
+
+/**
+ * Computes the singular value decomposition of a square matrix with one-sided Jacobi
+ * rotations, which make its columns orthogonal
+ * @param matrix The matrix, stored by rows
+ * @param size The width and height of the matrix
+ * @param left Overridden with the left singular vectors, stored by columns and scaled by
+ * their singular values
+ * @param right Overridden with the right singular vectors, stored by columns
+ * @param singular_values Overridden with the singular values, in no particular order
+ */
+void singular_value_decomposition(const double* matrix, const int& size, vector<double>& left,
+	vector<double>& right, vector<double>& singular_values) {
+	left.assign(matrix, matrix + size * size);
+	right.assign(static_cast<size_t>(size) * size, 0.0);
+	for (int i = 0; i < size; i++) {
+		right[i * size + i] = 1.0;
+	}
+	for (int sweep = 0; sweep < MAX_SVD_SWEEPS; sweep++) {
+		bool rotated = false;
+		for (int p = 0; p < size - 1; p++) {
+			for (int q = p + 1; q < size; q++) {
+				double alpha = 0.0, beta = 0.0, gamma = 0.0;
+				for (int i = 0; i < size; i++) {
+					alpha += left[i * size + p] * left[i * size + p];
+					beta += left[i * size + q] * left[i * size + q];
+					gamma += left[i * size + p] * left[i * size + q];
+				}
+				if (fabs(gamma) <= SVD_EPSILON * sqrt(alpha * beta)) {
+					continue;
+				}
+				// The rotation that makes columns p and q orthogonal
+				rotated = true;
+				const double zeta = (beta - alpha) / (2.0 * gamma);
+				const double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+				const double cosine = 1.0 / sqrt(1.0 + t * t);
+				const double sine = cosine * t;
+				for (vector<double>* vectors : {&left, &right}) {
+					for (int i = 0; i < size; i++) {
+						const double a = (*vectors)[i * size + p];
+						const double b = (*vectors)[i * size + q];
+						(*vectors)[i * size + p] = cosine * a - sine * b;
+						(*vectors)[i * size + q] = sine * a + cosine * b;
+					}
+				}
+			}
+		}
+		if (!rotated) {
+			break;
+		}
+	}
+	singular_values.assign(size, 0.0);
+	for (int j = 0; j < size; j++) {
+		for (int i = 0; i < size; i++) {
+			singular_values[j] += left[i * size + j] * left[i * size + j];
+		}
+		singular_values[j] = sqrt(singular_values[j]);
+	}
+}
+
+
+/**
+ * Adds the weighted taps of every group to the totals of one output row
+ * @param source The padded source image
+ * @param taps The tap groups
+ * @param weights The weight of each group
+ * @param c The plane
+ * @param i The output row
+ * @param x The first output column
+ * @param sums Scratch space for the sum of a group, one per output column
+ * @param totals The totals of the output row
+ */
+template <typename Weight, typename Total>
+void accumulate_taps(const PlanarImage& source, const vector<TapGroup>& taps, const vector<Weight>& weights,
+	const int& c, const int& i, const int& x, vector<int32_t>& sums, vector<Total>& totals) {
+	const int columns = static_cast<int>(totals.size());
+	for (size_t g = 0; g < taps.size(); g++) {
+		const TapGroup& group = taps[g];
+		const Weight weight = weights[g];
+		const size_t count = group.rows.size();
+		const uint8_t* first = source.getRow(c, i - group.rows[0]) + x - group.columns[0];
+		if (count == 1) {
+			for (int j = 0; j < columns; j++) {
+				totals[j] += first[j] * weight;
+			}
+			continue;
+		}
+		const uint8_t* second = source.getRow(c, i - group.rows[1]) + x - group.columns[1];
+		if (count == 2) {
+			for (int j = 0; j < columns; j++) {
+				totals[j] += (first[j] + second[j]) * weight;
+			}
+			continue;
+		}
+		// Larger groups are summed exactly before the single multiplication
+		for (int j = 0; j < columns; j++) {
+			sums[j] = first[j] + second[j];
+		}
+		for (size_t t = 2; t < count; t++) {
+			const uint8_t* row = source.getRow(c, i - group.rows[t]) + x - group.columns[t];
+			for (int j = 0; j < columns; j++) {
+				sums[j] += row[j];
+			}
+		}
+		for (int j = 0; j < columns; j++) {
+			totals[j] += sums[j] * weight;
+		}
+	}
+}
+
+
+/**
+ * Adds values weighted by a one-dimensional kernel to a row of totals. A tap with the same
+ * weight as its mirror image shares one multiplication with it.
+ * @param center The values under the center tap
+ * @param step Distance between the values under two neighboring taps
+ * @param weights The kernel
+ * @param totals The totals
+ * @param columns The number of totals
+ */
+template <typename Value, typename Weight, typename Total>
+void accumulate_line(const Value* center, const ptrdiff_t& step, const vector<Weight>& weights,
+	Total* totals, const int& columns) {
+	const int radius = static_cast<int>(weights.size()) / 2;
+	for (int l = -radius; l <= radius; l++) {
+		const Weight weight = weights[l + radius];
+		const bool mirrored = l != 0 && weights[radius - l] == weight;
+		// Zero taps are skipped, and taps right of the center are added with their mirror
+		if (weight == 0 || (mirrored && l > 0)) {
+			continue;
+		}
+		const Value* tap = center - l * step;
+		if (mirrored) {
+			const Value* mirror = center + l * step;
+			for (int j = 0; j < columns; j++) {
+				totals[j] += (tap[j] + mirror[j]) * weight;
+			}
+		}
+		else {
+			for (int j = 0; j < columns; j++) {
+				totals[j] += tap[j] * weight;
+			}
+		}
+	}
+}
+
+
+/**
+ * Convolves planes by multiplication in the frequency domain, splitting them into blocks
+ * whose results are overlapped and added
+ * @param channels The number of planes
+ * @param width The width of the planes
+ * @param height The height of the planes
+ * @param kernel The kernel matrix
+ * @param kernel_rows The width and height of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+ * @param source_row Returns the first value of a row of a plane, given the plane and the
+ * row; rows and columns as far as the kernel radius outside the plane are read too
+ * @param totals Overridden with the results, one plane after another
+ */
+template <typename SourceRow>
+void overlap_add(const int& channels, const int& width, const int& height, const double* kernel,
+	const int& kernel_rows, const double& scalar, const SourceRow& source_row, vector<double>& totals) {
+	const int kernel_radius = kernel_rows / 2;
+
+	// The padded source is the input; it is cut into blocks whose full linear convolution
+	// with the kernel exactly fills a transform, so there is no circular wrap-around
+	const int domain_width = width + 2 * kernel_radius;
+	const int domain_height = height + 2 * kernel_radius;
+	const FFT2D fft(fft_block_size(kernel_rows, domain_width), fft_block_size(kernel_rows, domain_height));
+	const int fft_width = fft.getWidth();
+	const int fft_height = fft.getHeight();
+	const int block_width = fft_width - kernel_rows + 1;
+	const int block_height = fft_height - kernel_rows + 1;
+	const size_t fft_size = static_cast<size_t>(fft_width) * fft_height;
+
+	// Transform the kernel once, with the scalar and the normalization of the inverse folded in
+	vector<Complex> kernel_spectrum(fft_size);
+	const double factor = scalar / fft_size;
+	for (int i = 0; i < kernel_rows; i++) {
+		for (int j = 0; j < kernel_rows; j++) {
+			kernel_spectrum[i * fft_width + j] = kernel[i * kernel_rows + j] * factor;
+		}
+	}
+	fft.transform(&kernel_spectrum[0], false);
+
+	// The output of a block spans at most two blocks along each axis, so blocks that are
+	// two apart never overlap. Four passes over alternating blocks can each run in parallel.
+	const int blocks_x = (domain_width + block_width - 1) / block_width;
+	const int blocks_y = (domain_height + block_height - 1) / block_height;
+	totals.assign(static_cast<size_t>(channels) * width * height, 0.0);
+	for (int pass = 0; pass < 4; pass++) {
+		vector<int> blocks;
+		for (int c = 0; c < channels; c++) {
+			for (int by = pass / 2; by < blocks_y; by += 2) {
+				for (int bx = pass % 2; bx < blocks_x; bx += 2) {
+					blocks.push_back((c * blocks_y + by) * blocks_x + bx);
+				}
+			}
+		}
+		// Both the input and the kernel are real, so two blocks share one complex transform:
+		// one in the real part and one in the imaginary part
+		const int pairs = static_cast<int>(blocks.size() + 1) / 2;
+		parallel_for(pairs, [&](const int& index) {
+			vector<Complex> data(fft_size);
+			const int count = min(2, static_cast<int>(blocks.size()) - 2 * index);
+			for (int part = 0; part < count; part++) {
+				const int block = blocks[2 * index + part];
+				const int c = block / (blocks_x * blocks_y);
+				const int y0 = block / blocks_x % blocks_y * block_height;
+				const int x0 = block % blocks_x * block_width;
+				const int rows = min(block_height, domain_height - y0);
+				const int columns = min(block_width, domain_width - x0);
+				for (int i = 0; i < rows; i++) {
+					const auto* row = source_row(c, y0 + i - kernel_radius) + x0 - kernel_radius;
+					Complex* data_row = &data[static_cast<size_t>(i) * fft_width];
+					for (int j = 0; j < columns; j++) {
+						data_row[j] += part == 0 ? Complex(row[j], 0.0) : Complex(0.0, row[j]);
+					}
+				}
+			}
+			fft.transform(&data[0], false);
+			for (size_t i = 0; i < fft_size; i++) {
+				data[i] *= kernel_spectrum[i];
+			}
+			fft.transform(&data[0], true);
+			// Add the results to the output pixels they overlap
+			for (int part = 0; part < count; part++) {
+				const int block = blocks[2 * index + part];
+				const int c = block / (blocks_x * blocks_y);
+				const int y0 = block / blocks_x % blocks_y * block_height - 2 * kernel_radius;
+				const int x0 = block % blocks_x * block_width - 2 * kernel_radius;
+				double* plane_totals = &totals[static_cast<size_t>(c) * width * height];
+				for (int i = max(0, -y0); i < min(fft_height, height - y0); i++) {
+					const Complex* data_row = &data[static_cast<size_t>(i) * fft_width];
+					double* row_totals = plane_totals + static_cast<size_t>(y0 + i) * width + x0;
+					for (int j = max(0, -x0); j < min(fft_width, width - x0); j++) {
+						row_totals[j] += part == 0 ? data_row[j].real() : data_row[j].imag();
+					}
+				}
+			}
+		});
+	}
+}
+
+}
+
+
+void convolution_tile_size(const int& kernel_radius, const size_t& input_bytes, int& tile_width, int& tile_height) {
+	const size_t kernel_rows = 2 * kernel_radius + 1;
+	// Half of each cache is left for the kernel, the output and everything else
+	const size_t l1_budget = cache_size(1) / 2;
+	const size_t l2_budget = cache_size(2) / 2;
+	const size_t columns = l1_budget / (sizeof(double) + kernel_rows * input_bytes);
+	tile_width = static_cast<int>(max(ROW_ALIGNMENT, columns / ROW_ALIGNMENT * ROW_ALIGNMENT));
+	const size_t input_rows = l2_budget / ((tile_width + 2 * kernel_radius) * input_bytes);
+	const size_t rows = input_rows > kernel_rows ? input_rows - 2 * kernel_radius : 0;
+	tile_height = static_cast<int>(max(MIN_TILE_HEIGHT, rows));
+}
+
+
+void for_each_tile(const PlanarImage& image, const int& tile_width, const int& tile_height,
+	const function<void(int, int, int, int, int)>& task) {
+	const int width = image.getWidth();
+	const int height = image.getHeight();
+	const int tile_cols = (width + tile_width - 1) / tile_width;
+	const int tile_rows = (height + tile_height - 1) / tile_height;
+	const int tiles = tile_cols * tile_rows;
+	parallel_for(image.getChannels() * tiles, [&](const int& index) {
+		const int x = index % tiles % tile_cols * tile_width;
+		const int y = index % tiles / tile_cols * tile_height;
+		task(index / tiles, x, y, min(tile_width, width - x), min(tile_height, height - y));
+	});
+}
+
+
+bool to_fixed_point(const double* kernel, const size_t& kernel_size, const double& scalar, FixedPointKernel& fixed) {
+	if (integer_weights(kernel, kernel_size, fixed.weights)) {
+		set_multiplier(scalar, fixed);
+		return MAX_PIXEL * weight_sum(fixed.weights) <= INT32_MAX;
+	}
+	// Fold the scalar into the weights, with as many fractional bits as 16-bit weights
+	// and 32-bit totals allow
+	double largest = 0.0;
+	double sum = 0.0;
+	for (size_t i = 0; i < kernel_size; i++) {
+		largest = max(largest, fabs(kernel[i] * scalar));
+		sum += fabs(kernel[i] * scalar);
+	}
+	int shift = 0;
+	while (shift < MAX_WEIGHT_SHIFT && largest * ldexp(1.0, shift + 1) <= INT16_MAX
+		&& MAX_PIXEL * sum * ldexp(1.0, shift + 1) <= INT32_MAX / 2) {
+		shift++;
+	}
+	double error = 0.0;
+	for (size_t i = 0; i < kernel_size; i++) {
+		const double weight = kernel[i] * scalar;
+		fixed.weights[i] = static_cast<int16_t>(lround(weight * ldexp(1.0, shift)));
+		error += fabs(weight - ldexp(fixed.weights[i], -shift));
+	}
+	fixed.multiplier = 1;
+	fixed.shift = shift;
+	return MAX_PIXEL * error <= FIXED_POINT_TOLERANCE && MAX_PIXEL * weight_sum(fixed.weights) <= INT32_MAX;
+}
+
+
+bool separate_fixed_point(const double* kernel, const int& kernel_rows, const double& scalar,
+	FixedPointKernel& column, FixedPointKernel& row) {
+	vector<int16_t> weights;
+	vector<double> column_factor, row_factor;
+	if (!integer_weights(kernel, kernel_rows * kernel_rows, weights)
+		|| !separate_kernel(kernel, kernel_rows, scalar, column_factor, row_factor)) {
+		return false;
+	}
+	// Take the kernel row with the largest entries, divided by the greatest common divisor
+	// of its entries, as the row factor
+	int pivot_row = 0;
+	for (int i = 1; i < kernel_rows; i++) {
+		if (fabs(column_factor[i]) > fabs(column_factor[pivot_row])) {
+			pivot_row = i;
+		}
+	}
+	int divisor = 0;
+	int pivot_col = 0;
+	for (int j = 0; j < kernel_rows; j++) {
+		int a = abs(static_cast<int>(weights[pivot_row * kernel_rows + j]));
+		int b = divisor;
+		while (b != 0) {
+			const int remainder = a % b;
+			a = b;
+			b = remainder;
+		}
+		divisor = a;
+		if (abs(weights[pivot_row * kernel_rows + j]) > abs(weights[pivot_row * kernel_rows + pivot_col])) {
+			pivot_col = j;
+		}
+	}
+	if (divisor == 0) {
+		return false;
+	}
+	row.weights.resize(kernel_rows);
+	column.weights.resize(kernel_rows);
+	for (int j = 0; j < kernel_rows; j++) {
+		row.weights[j] = static_cast<int16_t>(weights[pivot_row * kernel_rows + j] / divisor);
+	}
+	// The column factor follows from the pivot column, and must reproduce the kernel exactly
+	for (int i = 0; i < kernel_rows; i++) {
+		column.weights[i] = static_cast<int16_t>(weights[i * kernel_rows + pivot_col] / row.weights[pivot_col]);
+		for (int j = 0; j < kernel_rows; j++) {
+			if (column.weights[i] * row.weights[j] != weights[i * kernel_rows + j]) {
+				return false;
+			}
+		}
+	}
+	row.multiplier = 1;
+	row.shift = 0;
+	set_multiplier(scalar, column);
+	return MAX_PIXEL * weight_sum(row.weights) * weight_sum(column.weights) <= INT32_MAX;
+}
+
+
+bool separate_kernel(const double* kernel, const int& kernel_rows, const double& scalar,
+	vector<double>& column, vector<double>& row) {
+	column.assign(kernel_rows, 0.0);
+	row.assign(kernel_rows, 0.0);
+	// Pivot on the largest entry
+	int pivot = 0;
+	for (int i = 1; i < kernel_rows * kernel_rows; i++) {
+		if (fabs(kernel[i]) > fabs(kernel[pivot])) {
+			pivot = i;
+		}
+	}
+	const double largest = fabs(kernel[pivot]);
+	if (largest == 0.0) {
+		return true;
+	}
+	const int pivot_row = pivot / kernel_rows;
+	const int pivot_col = pivot % kernel_rows;
+	for (int i = 0; i < kernel_rows; i++) {
+		column[i] = kernel[i * kernel_rows + pivot_col];
+		row[i] = kernel[pivot_row * kernel_rows + i] / kernel[pivot];
+	}
+	// The kernel is separable if the outer product reproduces every entry
+	bool exact = true;
+	for (int i = 0; i < kernel_rows && exact; i++) {
+		for (int j = 0; j < kernel_rows && exact; j++) {
+			exact = fabs(kernel[i * kernel_rows + j] - column[i] * row[j]) <= largest * SEPARABLE_TOLERANCE;
+		}
+	}
+	if (exact) {
+		return true;
+	}
+	// Otherwise, such as for a rounded kernel, take the largest singular value and its vectors
+	vector<double> left, right, singular_values;
+	singular_value_decomposition(kernel, kernel_rows, left, right, singular_values);
+	const int largest_value = static_cast<int>(
+		max_element(singular_values.begin(), singular_values.end()) - singular_values.begin());
+	double error = 0.0;
+	for (int i = 0; i < kernel_rows; i++) {
+		column[i] = left[i * kernel_rows + largest_value];
+		row[i] = right[i * kernel_rows + largest_value];
+	}
+	for (int i = 0; i < kernel_rows; i++) {
+		for (int j = 0; j < kernel_rows; j++) {
+			error += fabs(kernel[i * kernel_rows + j] - column[i] * row[j]);
+		}
+	}
+	return MAX_PIXEL * fabs(scalar) * error <= FIXED_POINT_TOLERANCE;
+}
+
+
+KernelAnalysis analyze_kernel(const double* kernel, const size_t& kernel_size, const double& scalar) {
+	KernelAnalysis analysis;
+	analysis.kernel.assign(kernel, kernel + kernel_size);
+	analysis.scalar = scalar;
+	const int kernel_rows = analysis.kernel_rows = static_cast<int>(sqrt(kernel_size));
+	const int kernel_radius = kernel_rows / 2;
+
+	// Sparsity and symmetry, and the nonzero taps grouped by weight in order of appearance
+	analysis.nonzero = 0;
+	analysis.horizontal_symmetry = true;
+	analysis.vertical_symmetry = true;
+	map<double, size_t> groups;
+	for (int i = 0; i < kernel_rows; i++) {
+		for (int j = 0; j < kernel_rows; j++) {
+			const double entry = kernel[i * kernel_rows + j];
+			analysis.horizontal_symmetry &= entry == kernel[i * kernel_rows + kernel_rows - 1 - j];
+			analysis.vertical_symmetry &= entry == kernel[(kernel_rows - 1 - i) * kernel_rows + j];
+			if (entry == 0.0) {
+				continue;
+			}
+			analysis.nonzero++;
+			const auto group = groups.insert(make_pair(entry, analysis.taps.size()));
+			if (group.second) {
+				analysis.taps.push_back(TapGroup{entry, 0, {}, {}});
+			}
+			analysis.taps[group.first->second].rows.push_back(i - kernel_radius);
+			analysis.taps[group.first->second].columns.push_back(j - kernel_radius);
+		}
+	}
+
+	// Estimate the cost of every backend in taps per output pixel, and pick the cheapest.
+	// A tap costs a multiplication and an addition, but taps sharing a weight only add up
+	// their pixels before one multiplication, which costs about half as much.
+	FixedPointKernel fixed, fixed_column, fixed_row;
+	const bool direct_fixed = to_fixed_point(kernel, kernel_size, scalar, fixed);
+	// The floating-point factors are kept even if integer factors exist, for samples wider than 8 bits
+	analysis.separable = kernel_rows > 1
+		&& separate_kernel(kernel, kernel_rows, scalar, analysis.column, analysis.row);
+	const bool separable_fixed = analysis.separable
+		&& separate_fixed_point(kernel, kernel_rows, scalar, fixed_column, fixed_row);
+	analysis.method = 2 * analysis.nonzero < static_cast<int>(kernel_size)
+		? ConvolutionMethod::SPARSE : ConvolutionMethod::DIRECT;
+	analysis.fixed_point = direct_fixed;
+	double best_cost = (analysis.nonzero + analysis.taps.size()) / 2.0 * (direct_fixed ? FIXED_POINT_COST : 1.0);
+	if (analysis.separable) {
+		int factor_taps = 0;
+		for (int i = 0; i < kernel_rows; i++) {
+			factor_taps += separable_fixed
+				? (fixed_column.weights[i] != 0) + (fixed_row.weights[i] != 0)
+				: (analysis.column[i] != 0.0) + (analysis.row[i] != 0.0);
+		}
+		const double cost = factor_taps * (separable_fixed ? FIXED_POINT_COST : 1.0);
+		if (cost < best_cost) {
+			best_cost = cost;
+			analysis.method = ConvolutionMethod::SEPARABLE;
+			analysis.fixed_point = separable_fixed;
+		}
+	}
+	if (kernel_rows > 1) {
+		// Each block of the overlap-add takes a forward and an inverse transform, shared by
+		// two blocks, and only part of each block is new output
+		const double fft_rows = fft_target_size(kernel_rows);
+		const double block_rows = fft_rows - kernel_rows + 1;
+		const double cost = FFT_COST_FACTOR * log2(fft_rows * fft_rows) * (fft_rows * fft_rows) / (block_rows * block_rows);
+		if (cost < best_cost) {
+			best_cost = cost;
+			analysis.method = ConvolutionMethod::FFT;
+			analysis.fixed_point = false;
+		}
+	}
+
+	if (analysis.fixed_point && analysis.method == ConvolutionMethod::SEPARABLE) {
+		analysis.fixed = fixed_column;
+		analysis.fixed_row = fixed_row;
+	}
+	else if (analysis.fixed_point) {
+		analysis.fixed = fixed;
+		for (TapGroup& group : analysis.taps) {
+			const int index = (group.rows[0] + kernel_radius) * kernel_rows + group.columns[0] + kernel_radius;
+			group.fixed_weight = fixed.weights[index];
+		}
+	}
+	return analysis;
+}
+
+
+ConvolutionMethod float_method(const KernelAnalysis& analysis) {
+	return analysis.separable ? ConvolutionMethod::SEPARABLE : analysis.method;
+}
+
+
+string describe_kernel(const KernelAnalysis& analysis, const bool& float_planes) {
+	ostringstream description;
+	description << analysis.kernel_rows << "x" << analysis.kernel_rows << ", "
+		<< analysis.nonzero << " nonzero taps in " << analysis.taps.size() << " distinct weights, "
+		<< (analysis.separable ? "separable" : "not separable");
+	if (analysis.horizontal_symmetry && analysis.vertical_symmetry) {
+		description << ", symmetric";
+	}
+	else if (analysis.horizontal_symmetry) {
+		description << ", horizontally symmetric";
+	}
+	else if (analysis.vertical_symmetry) {
+		description << ", vertically symmetric";
+	}
+	switch (float_planes ? float_method(analysis) : analysis.method) {
+		case ConvolutionMethod::SEPARABLE:
+			description << "; separable passes";
+			break;
+		case ConvolutionMethod::FFT:
+			description << "; FFT";
+			break;
+		case ConvolutionMethod::SPARSE:
+			description << "; sparse taps";
+			break;
+		default:
+			description << "; direct taps";
+	}
+	if (float_planes) {
+		description << " on float planes";
+	}
+	else if (analysis.fixed_point) {
+		description << " in fixed point";
+	}
+	return description.str();
+}
+
+
+void convolve_planes(const PlanarImage& source, PlanarImage& dest, const KernelAnalysis& analysis) {
+	switch (analysis.method) {
+		case ConvolutionMethod::SEPARABLE:
+			if (analysis.fixed_point) {
+				convolve_separable_fixed(source, dest, analysis.fixed, analysis.fixed_row);
+			}
+			else {
+				convolve_separable(source, dest, analysis.column, analysis.row, analysis.scalar);
+			}
+			break;
+		case ConvolutionMethod::FFT:
+			convolve_fft(source, dest, &analysis.kernel[0], analysis.kernel_rows, analysis.scalar);
+			break;
+		default:
+			// Dense and sparse kernels share the tap list, which holds only nonzero taps
+			if (analysis.fixed_point) {
+				convolve_direct_fixed(source, dest, analysis.taps, analysis.fixed);
+			}
+			else {
+				convolve_direct(source, dest, analysis.taps, analysis.scalar);
+			}
+	}
+}
+
+
+void convolve_direct(const PlanarImage& source, PlanarImage& dest, const vector<TapGroup>& taps,
+	const double& scalar) {
+	int kernel_radius = 0;
+	vector<double> weights;
+	for (const TapGroup& group : taps) {
+		for (size_t t = 0; t < group.rows.size(); t++) {
+			kernel_radius = max(kernel_radius, max(abs(group.rows[t]), abs(group.columns[t])));
+		}
+		weights.push_back(group.weight * scalar);
+	}
+	int tile_width, tile_height;
+	convolution_tile_size(kernel_radius, 1, tile_width, tile_height);
+	for_each_tile(source, tile_width, tile_height, [&](int c, int x, int y, int columns, int rows) {
+		// Accumulate a whole output row of the tile at a time, one group of taps after another,
+		// so the innermost loops run over contiguous pixels without any bounds checks
+		vector<double> totals(columns);
+		vector<int32_t> sums(columns);
+		for (int i = y; i < y + rows; i++) {
+			fill(totals.begin(), totals.end(), 0.0);
+			accumulate_taps(source, taps, weights, c, i, x, sums, totals);
+			uint8_t* new_row = dest.getRow(c, i) + x;
+			for (int j = 0; j < columns; j++) {
+				new_row[j] = clamp_round(totals[j]);
+			}
+		}
+	});
+}
+
+
+void convolve_direct_fixed(const PlanarImage& source, PlanarImage& dest, const vector<TapGroup>& taps,
+	const FixedPointKernel& kernel) {
+	int kernel_radius = 0;
+	vector<int32_t> weights;
+	for (const TapGroup& group : taps) {
+		for (size_t t = 0; t < group.rows.size(); t++) {
+			kernel_radius = max(kernel_radius, max(abs(group.rows[t]), abs(group.columns[t])));
+		}
+		weights.push_back(group.fixed_weight);
+	}
+	int tile_width, tile_height;
+	convolution_tile_size(kernel_radius, 1, tile_width, tile_height);
+	for_each_tile(source, tile_width, tile_height, [&](int c, int x, int y, int columns, int rows) {
+		// Same order as the direct convolution, with 16-bit weights and 32-bit totals so
+		// the innermost loops vectorize over many more pixels at once
+		vector<int32_t> totals(columns);
+		vector<int32_t> sums(columns);
+		for (int i = y; i < y + rows; i++) {
+			fill(totals.begin(), totals.end(), 0);
+			accumulate_taps(source, taps, weights, c, i, x, sums, totals);
+			uint8_t* new_row = dest.getRow(c, i) + x;
+			for (int j = 0; j < columns; j++) {
+				new_row[j] = fixed_round(totals[j], kernel.multiplier, kernel.shift);
+			}
+		}
+	});
+}
+
+
+void convolve_separable(const PlanarImage& source, PlanarImage& dest, const vector<double>& column,
+	const vector<double>& row, const double& scalar) {
+	const int kernel_radius = static_cast<int>(column.size()) / 2;
+	int tile_width, tile_height;
+	convolution_tile_size(kernel_radius, sizeof(double), tile_width, tile_height);
+	for_each_tile(source, tile_width, tile_height, [&](int c, int x, int y, int columns, int rows) {
+		// Horizontal pass over the rows of the tile and the rows above and below it
+		const int pass_rows = rows + 2 * kernel_radius;
+		vector<double> horizontal(static_cast<size_t>(pass_rows) * columns, 0.0);
+		for (int i = 0; i < pass_rows; i++) {
+			const uint8_t* source_row = source.getRow(c, y - kernel_radius + i) + x;
+			accumulate_line(source_row, 1, row, &horizontal[static_cast<size_t>(i) * columns], columns);
+		}
+		// Vertical pass over the horizontal results
+		vector<double> totals(columns);
+		for (int i = 0; i < rows; i++) {
+			fill(totals.begin(), totals.end(), 0.0);
+			accumulate_line(&horizontal[static_cast<size_t>(i + kernel_radius) * columns], columns, column,
+				&totals[0], columns);
+			uint8_t* new_row = dest.getRow(c, y + i) + x;
+			for (int j = 0; j < columns; j++) {
+				new_row[j] = clamp_round(totals[j] * scalar);
+			}
+		}
+	});
+}
+
+
+void convolve_separable_fixed(const PlanarImage& source, PlanarImage& dest, const FixedPointKernel& column,
+	const FixedPointKernel& row) {
+	const int kernel_radius = static_cast<int>(column.weights.size()) / 2;
+	int tile_width, tile_height;
+	convolution_tile_size(kernel_radius, sizeof(int32_t), tile_width, tile_height);
+	for_each_tile(source, tile_width, tile_height, [&](int c, int x, int y, int columns, int rows) {
+		// Horizontal pass over the rows of the tile and the rows above and below it
+		const int pass_rows = rows + 2 * kernel_radius;
+		vector<int32_t> horizontal(static_cast<size_t>(pass_rows) * columns, 0);
+		for (int i = 0; i < pass_rows; i++) {
+			const uint8_t* source_row = source.getRow(c, y - kernel_radius + i) + x;
+			accumulate_line(source_row, 1, row.weights, &horizontal[static_cast<size_t>(i) * columns], columns);
+		}
+		// Vertical pass over the horizontal totals, which are exact integers
+		vector<int32_t> totals(columns);
+		for (int i = 0; i < rows; i++) {
+			fill(totals.begin(), totals.end(), 0);
+			accumulate_line(&horizontal[static_cast<size_t>(i + kernel_radius) * columns], columns,
+				column.weights, &totals[0], columns);
+			uint8_t* new_row = dest.getRow(c, y + i) + x;
+			for (int j = 0; j < columns; j++) {
+				new_row[j] = fixed_round(totals[j], column.multiplier, column.shift);
+			}
+		}
+	});
+}
+
+
+void convolve_float(const float* source, const int& source_stride, float* dest, const int& dest_stride,
+	const int& width, const int& height, const KernelAnalysis& analysis) {
+	const int kernel_radius = analysis.kernel_rows / 2;
+	const float scalar = static_cast<float>(analysis.scalar);
+	const ConvolutionMethod method = float_method(analysis);
+	if (method == ConvolutionMethod::SEPARABLE) {
+		const vector<float> column(analysis.column.begin(), analysis.column.end());
+		const vector<float> row(analysis.row.begin(), analysis.row.end());
+		// Bands of rows are independent, and each takes its own horizontal pass over the
+		// rows it reads, so the intermediate rows stay in the cache
+		int tile_width, tile_height;
+		convolution_tile_size(kernel_radius, sizeof(float), tile_width, tile_height);
+		const int bands = (height + tile_height - 1) / tile_height;
+		parallel_for(bands, [&](const int& band) {
+			const int y = band * tile_height;
+			const int rows = min(tile_height, height - y);
+			const int pass_rows = rows + 2 * kernel_radius;
+			vector<float> horizontal(static_cast<size_t>(pass_rows) * width, 0.0f);
+			for (int i = 0; i < pass_rows; i++) {
+				const float* source_row = source + static_cast<ptrdiff_t>(y - kernel_radius + i) * source_stride;
+				accumulate_line(source_row, 1, row, &horizontal[static_cast<size_t>(i) * width], width);
+			}
+			for (int i = 0; i < rows; i++) {
+				float* new_row = dest + static_cast<ptrdiff_t>(y + i) * dest_stride;
+				fill(new_row, new_row + width, 0.0f);
+				accumulate_line(&horizontal[static_cast<size_t>(i + kernel_radius) * width], width, column,
+					new_row, width);
+				for (int j = 0; j < width; j++) {
+					new_row[j] *= scalar;
+				}
+			}
+		});
+		return;
+	}
+	if (method == ConvolutionMethod::FFT) {
+		convolve_fft(source, source_stride, dest, dest_stride, width, height, &analysis.kernel[0],
+			analysis.kernel_rows, analysis.scalar);
+		return;
+	}
+	vector<float> weights;
+	for (const TapGroup& group : analysis.taps) {
+		weights.push_back(static_cast<float>(group.weight * analysis.scalar));
+	}
+	parallel_for(height, [&](const int& i) {
+		float* new_row = dest + static_cast<ptrdiff_t>(i) * dest_stride;
+		fill(new_row, new_row + width, 0.0f);
+		vector<float> sums(width);
+		for (size_t g = 0; g < analysis.taps.size(); g++) {
+			const TapGroup& group = analysis.taps[g];
+			fill(sums.begin(), sums.end(), 0.0f);
+			for (size_t t = 0; t < group.rows.size(); t++) {
+				const float* tap = source + static_cast<ptrdiff_t>(i - group.rows[t]) * source_stride - group.columns[t];
+				for (int j = 0; j < width; j++) {
+					sums[j] += tap[j];
+				}
+			}
+			for (int j = 0; j < width; j++) {
+				new_row[j] += sums[j] * weights[g];
+			}
+		}
+	});
+}
+
+
+void convolve_fft(const PlanarImage& source, PlanarImage& dest, const double* kernel,
+	const int& kernel_rows, const double& scalar) {
+	const int width = source.getWidth();
+	const int height = source.getHeight();
+	const int channels = source.getChannels();
+	vector<double> totals;
+	overlap_add(channels, width, height, kernel, kernel_rows, scalar, [&](const int& c, const int& i) {
+		return source.getRow(c, i);
+	}, totals);
+	for (int c = 0; c < channels; c++) {
+		for (int i = 0; i < height; i++) {
+			const double* row_totals = &totals[(static_cast<size_t>(c) * height + i) * width];
+			uint8_t* new_row = dest.getRow(c, i);
+			for (int j = 0; j < width; j++) {
+				new_row[j] = clamp_round(row_totals[j]);
+			}
+		}
+	}
+}
+
+
+void convolve_fft(const float* source, const int& source_stride, float* dest, const int& dest_stride,
+	const int& width, const int& height, const double* kernel, const int& kernel_rows, const double& scalar) {
+	vector<double> totals;
+	overlap_add(1, width, height, kernel, kernel_rows, scalar, [&](const int&, const int& i) {
+		return source + static_cast<ptrdiff_t>(i) * source_stride;
+	}, totals);
+	for (int i = 0; i < height; i++) {
+		copy(&totals[static_cast<size_t>(i) * width], &totals[static_cast<size_t>(i) * width] + width,
+			dest + static_cast<ptrdiff_t>(i) * dest_stride);
+	}
+}
@@ -0,0 +1,274 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "util.h"
+
+/*
+ * Convolution backends for planar images. Every backend reads taps outside of the
+ * image from the border of the source, so its padding must be at least the kernel
+ * radius and the border must already be filled. Each writes every pixel of the
+ * destination, which has the size and number of planes of the source.
+ */
+
+
+/**
+ * A kernel with 16-bit fixed-point weights. An output pixel is the weighted sum of its
+ * neighbors, multiplied by the multiplier and shifted right by shift bits.
+*/
+struct FixedPointKernel {
+	std::vector<std::int16_t> weights;	// The weights, in the order of the kernel entries
+	std::int64_t multiplier;	// Applied to the weighted sum
+	int shift;	// Right shift applied after the multiplier
+};
+
+
+/**
+ * The backends a kernel can be convolved with
+*/
+enum class ConvolutionMethod {
+	DIRECT,	// Tap by tap
+	SPARSE,	// Tap by tap, for kernels that are mostly zero
+	SEPARABLE,	// A horizontal and then a vertical pass
+	FFT	// Multiplication in the frequency domain
+};
+
+
+/**
+ * Nonzero taps of a kernel that share a weight. The pixels under all of them are added
+ * before the weight is applied, so a symmetric kernel needs half the multiplications.
+*/
+struct TapGroup {
+	double weight;	// The kernel entry
+	std::int16_t fixed_weight;	// The fixed-point weight, if the kernel has one
+	std::vector<int> rows;	// Vertical offset of each tap from the center
+	std::vector<int> columns;	// Horizontal offset of each tap from the center
+};
+
+
+/**
+ * The shape of a kernel and the backend that convolves it most cheaply
+*/
+struct KernelAnalysis {
+	std::vector<double> kernel;	// The kernel matrix
+	double scalar;	// A scalar by which to multiply the kernel
+	int kernel_rows;	// The width and height of the kernel
+	int nonzero;	// Number of nonzero entries
+	bool separable;	// Whether the kernel is the outer product of a column and a row
+	bool horizontal_symmetry;	// Whether every row reads the same in both directions
+	bool vertical_symmetry;	// Whether every column reads the same in both directions
+	std::vector<TapGroup> taps;	// The nonzero taps, grouped by weight
+	ConvolutionMethod method;	// The chosen backend
+	bool fixed_point;	// Whether the chosen backend runs in fixed point
+	std::vector<double> column;	// Vertical factor of a separable kernel
+	std::vector<double> row;	// Horizontal factor of a separable kernel
+	FixedPointKernel fixed;	// Fixed-point kernel, or its vertical factor if it is separable
+	FixedPointKernel fixed_row;	// Fixed-point horizontal factor of a separable kernel
+};
+
+
+/**
+ * Picks the size of the output tiles of a convolution. A tile is narrow enough that the
+ * accumulators of one of its rows and the input rows they read stay in the L1 cache, and
+ * short enough that all input rows of the tile stay in the L2 cache.
+ * @param kernel_radius The radius of the kernel
+ * @param input_bytes The size of one input value of a tile in bytes
+ * @param tile_width Overridden with the width of a tile
+ * @param tile_height Overridden with the height of a tile
+*/
+void convolution_tile_size(const int& kernel_radius, const size_t& input_bytes, int& tile_width, int& tile_height);
+
+
+/**
+ * Runs a task for every tile of every plane of an image on the thread pool
+ * @param image The image
+ * @param tile_width The width of a tile
+ * @param tile_height The height of a tile
+ * @param task Called with the plane, the top left corner and the size of a tile
+*/
+void for_each_tile(const PlanarImage& image, const int& tile_width, const int& tile_height,
+	const std::function<void(int, int, int, int, int)>& task);
+
+
+/**
+ * Converts a kernel and its scalar to fixed point. Integer-valued kernels keep their exact
+ * weights and the scalar becomes the multiplier; other kernels have the scalar folded into
+ * the weights, which is only accepted if the rounding error stays far below one level.
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @param fixed Overridden with the fixed-point kernel
+ * @return Whether the kernel can be evaluated in fixed point on 8-bit data
+*/
+bool to_fixed_point(const double* kernel, const size_t& kernel_size, const double& scalar,
+	FixedPointKernel& fixed);
+
+
+/**
+ * Splits an integer-valued kernel into integer column and row vectors whose outer product
+ * is the kernel, and converts its scalar to a fixed-point multiplier
+ * @param kernel The kernel matrix
+ * @param kernel_rows The width and height of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+ * @param column Overridden with the vertical factor; its multiplier and shift apply to the result
+ * @param row Overridden with the horizontal factor
+ * @return Whether the kernel has integer factors that can be evaluated in fixed point
+*/
+bool separate_fixed_point(const double* kernel, const int& kernel_rows, const double& scalar,
+	FixedPointKernel& column, FixedPointKernel& row);
+
+
+/**
+ * Splits a kernel into a column and a row vector whose outer product is the kernel. Kernels
+ * that are not exactly separable fall back to their best rank-one approximation, found by
+ * singular value decomposition, but only if its error stays within 1/64 of a level.
+ * @param kernel The kernel matrix
+ * @param kernel_rows The width and height of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+ * @param column Overridden with the column vector
+ * @param row Overridden with the row vector
+ * @return Whether the kernel is separable
+*/
+bool separate_kernel(const double* kernel, const int& kernel_rows, const double& scalar,
+	std::vector<double>& column, std::vector<double>& row);
+
+
+/**
+ * Measures the size, sparsity, symmetry and rank of a kernel, and picks the backend with
+ * the lowest estimated cost per output pixel
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @return The analysis
+*/
+KernelAnalysis analyze_kernel(const double* kernel, const size_t& kernel_size, const double& scalar);
+
+
+/**
+ * Returns the backend that convolve_float picks for a kernel
+ * @param analysis The analysis of the kernel
+ * @return The backend; tap groups serve both DIRECT and SPARSE
+*/
+ConvolutionMethod float_method(const KernelAnalysis& analysis);
+
+
+/**
+ * Summarizes an analysis in one line, such as "5x5, 25 nonzero taps, separable, symmetric;
+ * separable passes in fixed point"
+ * @param analysis The analysis
+ * @param float_planes Whether the kernel runs on float planes instead of 8-bit planes,
+ * which changes the backend
+ * @return The summary
+*/
+std::string describe_kernel(const KernelAnalysis& analysis, const bool& float_planes);
+
+
+/**
+ * Convolves every plane with the backend chosen by the analysis
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param analysis The analysis of the kernel
+*/
+void convolve_planes(const PlanarImage& source, PlanarImage& dest, const KernelAnalysis& analysis);
+
+
+/**
+ * Convolves every plane one group of taps after another, in cache-sized tiles
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param taps The nonzero taps of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+*/
+void convolve_direct(const PlanarImage& source, PlanarImage& dest, const std::vector<TapGroup>& taps,
+	const double& scalar);
+
+
+/**
+ * Convolves every plane one group of taps after another in 32-bit integer arithmetic, in
+ * cache-sized tiles
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param taps The nonzero taps of the kernel, with their fixed-point weights
+ * @param kernel The fixed-point kernel, whose multiplier and shift apply to the result
+*/
+void convolve_direct_fixed(const PlanarImage& source, PlanarImage& dest, const std::vector<TapGroup>& taps,
+	const FixedPointKernel& kernel);
+
+
+/**
+ * Convolves every plane with a horizontal and then a vertical pass, in cache-sized tiles
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param column The vertical factor of the kernel
+ * @param row The horizontal factor of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+*/
+void convolve_separable(const PlanarImage& source, PlanarImage& dest, const std::vector<double>& column,
+	const std::vector<double>& row, const double& scalar);
+
+
+/**
+ * Convolves every plane with a horizontal and then a vertical pass in 32-bit integer
+ * arithmetic, in cache-sized tiles
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param column The vertical factor of the kernel, with the multiplier and shift of the result
+ * @param row The horizontal factor of the kernel
+*/
+void convolve_separable_fixed(const PlanarImage& source, PlanarImage& dest, const FixedPointKernel& column,
+	const FixedPointKernel& row);
+
+
+/**
+ * Convolves a plane of floating-point values, which holds 16-bit or float samples. Separable
+ * kernels take a horizontal and a vertical pass, kernels for which the analysis picked the
+ * FFT go through the frequency domain, and other kernels take one group of taps after
+ * another; rows are spread over the thread pool.
+ * @param source The top left value of the source, whose border is filled at least as wide
+ * as the kernel radius
+ * @param source_stride Values between the starts of two rows of the source
+ * @param dest The top left value of the destination
+ * @param dest_stride Values between the starts of two rows of the destination
+ * @param width The width of the plane
+ * @param height The height of the plane
+ * @param analysis The analysis of the kernel
+*/
+void convolve_float(const float* source, const int& source_stride, float* dest, const int& dest_stride,
+	const int& width, const int& height, const KernelAnalysis& analysis);
+
+
+/**
+ * Convolves every plane by multiplication in the frequency domain, splitting the planes
+ * into blocks whose results are overlapped and added
+ * @param source The padded source image
+ * @param dest The destination image
+ * @param kernel The kernel matrix
+ * @param kernel_rows The width and height of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+*/
+void convolve_fft(const PlanarImage& source, PlanarImage& dest, const double* kernel,
+	const int& kernel_rows, const double& scalar);
+
+
+/**
+ * Convolves a plane of floating-point values by multiplication in the frequency domain,
+ * splitting it into blocks whose results are overlapped and added
+ * @param source The top left value of the source, whose border is filled at least as wide
+ * as the kernel radius
+ * @param source_stride Values between the starts of two rows of the source
+ * @param dest The top left value of the destination
+ * @param dest_stride Values between the starts of two rows of the destination
+ * @param width The width of the plane
+ * @param height The height of the plane
+ * @param kernel The kernel matrix
+ * @param kernel_rows The width and height of the kernel
+ * @param scalar A scalar by which to multiply the kernel
+*/
+void convolve_fft(const float* source, const int& source_stride, float* dest, const int& dest_stride,
+	const int& width, const int& height, const double* kernel, const int& kernel_rows, const double& scalar);
+
+
+#endif
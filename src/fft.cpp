@@ -0,0 +1,146 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include "fft.h"
+using namespace std;
+
+
+typedef complex<double> Complex;
+
+
+FFT::FFT(const int& n) {
+	this->n = n;
+	forward_twiddles.resize(n);
+	inverse_twiddles.resize(n);
+	for (int k = 0; k < n; k++) {
+		const double phase = -2 * M_PI * k / n;
+		forward_twiddles[k] = Complex(cos(phase), sin(phase));
+		inverse_twiddles[k] = conj(forward_twiddles[k]);
+	}
+	// Factor into radix 4 stages first, then 2, 3, 5 and any remaining primes
+	int remaining = n;
+	int radix = 4;
+	const int root = static_cast<int>(floor(sqrt(static_cast<double>(n))));
+	while (remaining > 1) {
+		while (remaining % radix != 0) {
+			radix = radix == 4 ? 2 : radix == 2 ? 3 : radix + 2;
+			if (radix > root) {
+				radix = remaining;
+			}
+		}
+		remaining /= radix;
+		factors.push_back(radix);
+		factors.push_back(remaining);
+	}
+}
+
+
+void FFT::work(Complex* out, const Complex* in, const int& in_stride, const int& fstride, const int* stage,
+	const Complex* twiddles, const bool& inverse) const {
+	const int radix = stage[0];
+	const int m = stage[1];
+	// Transform each of the radix interleaved subsequences
+	for (int q = 0; q < radix; q++) {
+		if (m == 1) {
+			out[q] = in[q * fstride * in_stride];
+		}
+		else {
+			work(out + q * m, in + q * fstride * in_stride, in_stride, fstride * radix, stage + 2, twiddles, inverse);
+		}
+	}
+	// Combine them with butterflies
+	if (radix == 2) {
+		for (int k = 0; k < m; k++) {
+			const Complex t = out[k + m] * twiddles[k * fstride];
+			out[k + m] = out[k] - t;
+			out[k] += t;
+		}
+	}
+	else if (radix == 4) {
+		for (int k = 0; k < m; k++) {
+			const Complex s0 = out[k + m] * twiddles[k * fstride];
+			const Complex s1 = out[k + 2 * m] * twiddles[2 * k * fstride];
+			const Complex s2 = out[k + 3 * m] * twiddles[3 * k * fstride];
+			const Complex s3 = s0 + s2;
+			const Complex s4 = s0 - s2;
+			const Complex s5 = out[k] - s1;
+			const Complex s6 = out[k] + s1;
+			// Multiply s4 by -i (forward) or i (inverse)
+			const Complex rotated = inverse ? Complex(-s4.imag(), s4.real()) : Complex(s4.imag(), -s4.real());
+			out[k] = s6 + s3;
+			out[k + 2 * m] = s6 - s3;
+			out[k + m] = s5 + rotated;
+			out[k + 3 * m] = s5 - rotated;
+		}
+	}
+	else {
+		vector<Complex> scratch(radix);
+		for (int u = 0; u < m; u++) {
+			for (int q = 0; q < radix; q++) {
+				scratch[q] = out[u + q * m];
+			}
+			for (int q1 = 0; q1 < radix; q1++) {
+				const int k = u + q1 * m;
+				int twiddle = 0;
+				Complex total = scratch[0];
+				for (int q = 1; q < radix; q++) {
+					twiddle += fstride * k;
+					if (twiddle >= n) {
+						twiddle %= n;
+					}
+					total += scratch[q] * twiddles[twiddle];
+				}
+				out[k] = total;
+			}
+		}
+	}
+}
+
+
+void FFT::transform(const Complex* in, const int& in_stride, Complex* out, const bool& inverse) const {
+	if (n == 1) {
+		out[0] = in[0];
+		return;
+	}
+	work(out, in, in_stride, 1, &factors[0], inverse ? &inverse_twiddles[0] : &forward_twiddles[0], inverse);
+}
+
+
+int FFT::good_size(const int& n) {
+	int best = 1;
+	while (best < n) {
+		best *= 2;
+	}
+	// Try every product of powers of 3 and 5, topped up with powers of 2
+	for (int p5 = 1; p5 < best; p5 *= 5) {
+		for (int p35 = p5; p35 < best; p35 *= 3) {
+			int size = p35;
+			while (size < n) {
+				size *= 2;
+			}
+			best = min(best, size);
+		}
+	}
+	return best;
+}
+
+
+FFT2D::FFT2D(const int& width, const int& height) : row_fft(width), column_fft(height) {
+}
+
+
+void FFT2D::transform(Complex* data, const bool& inverse) const {
+	const int width = getWidth();
+	const int height = getHeight();
+	vector<Complex> buffer(max(width, height));
+	for (int i = 0; i < height; i++) {
+		Complex* row = data + static_cast<size_t>(i) * width;
+		row_fft.transform(row, 1, &buffer[0], inverse);
+		copy(buffer.begin(), buffer.begin() + width, row);
+	}
+	for (int j = 0; j < width; j++) {
+		column_fft.transform(data + j, width, &buffer[0], inverse);
+		for (int i = 0; i < height; i++) {
+			data[static_cast<size_t>(i) * width + j] = buffer[i];
+		}
+	}
+}
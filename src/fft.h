@@ -0,0 +1,79 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex>
+#include <vector>
+
+/**
+ * A complex fast Fourier transform of a fixed length. Lengths whose prime factors are
+ * 2, 3 and 5 are fast; other lengths work, but fall back to slow generic butterflies.
+*/
+class FFT {
+	int n;	// The length of the transform
+	std::vector<int> factors;	// Pairs of (radix, remaining length) for every stage
+	std::vector<std::complex<double>> forward_twiddles;	// e^(-2 pi i k / n)
+	std::vector<std::complex<double>> inverse_twiddles;	// e^(2 pi i k / n)
+
+	/**
+	 * Performs one stage of the mixed-radix decimation in time and recurses into the next
+	 */
+	void work(std::complex<double>* out, const std::complex<double>* in, const int& in_stride,
+		const int& fstride, const int* stage, const std::complex<double>* twiddles, const bool& inverse) const;
+
+public:
+	/**
+	 * Prepares a transform
+	 * @param n The length of the transform
+	 */
+	explicit FFT(const int& n);
+
+	int size() const { return n; }
+
+	/**
+	 * Transforms a sequence. The inverse transform is not normalized, so a forward and
+	 * an inverse transform multiply the sequence by n.
+	 * @param in The input sequence
+	 * @param in_stride The distance between two input elements
+	 * @param out The output sequence, which must not overlap the input
+	 * @param inverse Whether to perform the inverse transform
+	 */
+	void transform(const std::complex<double>* in, const int& in_stride, std::complex<double>* out,
+		const bool& inverse) const;
+
+	/**
+	 * Returns the smallest length that is at least n and only has the prime factors 2, 3 and 5
+	 * @param n The minimum length
+	 * @return The length
+	 */
+	static int good_size(const int& n);
+};
+
+
+/**
+ * A two-dimensional complex fast Fourier transform of a fixed size
+*/
+class FFT2D {
+	FFT row_fft;	// Transforms along each row
+	FFT column_fft;	// Transforms along each column
+
+public:
+	/**
+	 * Prepares a transform
+	 * @param width The number of columns
+	 * @param height The number of rows
+	 */
+	FFT2D(const int& width, const int& height);
+
+	int getWidth() const { return row_fft.size(); }
+	int getHeight() const { return column_fft.size(); }
+
+	/**
+	 * Transforms a block in place. The inverse transform is not normalized.
+	 * @param data The block in row-major order
+	 * @param inverse Whether to perform the inverse transform
+	 */
+	void transform(std::complex<double>* data, const bool& inverse) const;
+};
+
+
+#endif
@@ -5,115 +5,183 @@
 #include <cstdint>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 
 #include "util.h"
+#include "stencil.h"
 using namespace std;
 
 
+constexpr int LUMA_RED = 77;	// BT.601 luminance weight of red, in 256ths
+constexpr int LUMA_GREEN = 150;	// BT.601 luminance weight of green, in 256ths
+constexpr int LUMA_BLUE = 29;	// BT.601 luminance weight of blue, in 256ths
+
 // ASCII characters used in the output text in descending order of intensity
 const string ASCII_CHARS = "$@B%8&WM#*oahkbdpqwmZO0QLCJUYXzcvunxrjft/\\|()1{}[]?-_+~<>i!lI;:,\"^`'. ";
 
 
-ImageMatrix* pixelate(const ImageMatrix& image, const int& divs) {
-	const int width = image.getWidth();
-	const int height = image.getHeight();
-	const int bpp = image.getBpp();
-
+Pixelator::Pixelator(const int& width, const int& height, const int& divs) :
+	width(width), height(height), bpp(0), sample_type(SampleType::U8), next_in(0), next_out(0) {
 	// Determine new image info
 	const int longest_side = width > height ? width : height;
 	const double chunk_length = static_cast<double>(longest_side) / divs;	// Divisions on longest side
-	const int chunks = max(1, static_cast<int>(round(width / chunk_length) * round(height / chunk_length)));
-	const int width_pixels = width > height ? divs : max(1, static_cast<int>(round(width / chunk_length)));
-	const int height_pixels = height >= width ? divs : max(1, static_cast<int>(round(height / chunk_length)));
-	const double chunk_width = width > height ? chunk_length : static_cast<double>(width) / width_pixels;
-	const double chunk_height = height >= width ? chunk_length : static_cast<double>(height) / height_pixels;
-
-	// Create bit data for new image
-	const auto rgb_totals = new int[chunks * bpp]();	// Parentheses initialize all elements with 0
-	const auto num_ref_px = new int[chunks]();	// Number of reference pixels in each destination chunk
-	for (int i = 0; i < height; i++) {
+	width_pixels = width > height ? divs : max(1, static_cast<int>(round(width / chunk_length)));
+	height_pixels = height >= width ? divs : max(1, static_cast<int>(round(height / chunk_length)));
+	chunk_width = width > height ? chunk_length : static_cast<double>(width) / width_pixels;
+	chunk_height = height >= width ? chunk_length : static_cast<double>(height) / height_pixels;
+	new_width = width_pixels * static_cast<int>(round(chunk_length));	  // Width of new image
+	new_height = height_pixels * static_cast<int>(round(chunk_length)); // Height of new image
+	num_ref_px.assign(width_pixels * height_pixels, 0);
+}
+
+
+template <typename T>
+void Pixelator::add_samples(const ImageMatrix& rows, const int& first, const int& count) {
+	for (int r = first; r < first + count; r++, next_in++) {
+		const T* row = rows.getSamples<T>(r);
 		for (int j = 0; j < width; j++) {
-			// Index of pixel in original image
-			const int index = bpp * (j + i * width);
+			// Index of pixel in original image row
+			const int index = bpp * j;
 			// Index of pixel in pixelated image
 			const int chunk_col = floor((j + j + 1) / 2.0 / chunk_width);
-			const int chunk_row = floor((i + i + 1) / 2.0 / chunk_height);
+			const int chunk_row = floor((next_in + next_in + 1) / 2.0 / chunk_height);
 			const int chunk_index = bpp * (chunk_col + chunk_row * width_pixels);
 			// Add RGB values
 			for (int k = 0; k < bpp; k++) {
-				rgb_totals[chunk_index + k] += image.getImageData()[index + k];
+				rgb_totals[chunk_index + k] += row[index + k];
 			}
 			num_ref_px[chunk_index / bpp]++;
 		}
 	}
-	const int new_width = width_pixels * static_cast<int>(round(chunk_length));	  // Width of new image
-	const int new_height = height_pixels * static_cast<int>(round(chunk_length)); // Height of new image
-	auto* new_image = new uint8_t[new_width * new_height * bpp];
-	for (int i = 0; i < new_height; i++) {
+}
+
+
+template <typename T>
+void Pixelator::fill_samples(ImageMatrix& rows, const int& first, const int& count) {
+	for (int r = first; r < first + count; r++, next_out++) {
+		T* new_row = rows.getSamples<T>(r);
 		for (int j = 0; j < new_width; j++) {
-			// Index of pixel in new image
-			const int index = bpp * (j + i * new_width);
+			// Index of pixel in new image row
+			const int index = bpp * j;
 			// Index of pixel in pixelated image
 			const int chunk_col = j * width_pixels / new_width;
-			const int chunk_row = i * height_pixels / new_height;
+			const int chunk_row = next_out * height_pixels / new_height;
 			const int chunk_index = bpp * (chunk_col + chunk_row * width_pixels);
 			// Find average RGB value in chunk
 			for (int k = 0; k < bpp; k++) {
-				const int rgb_total = rgb_totals[chunk_index + k];
+				const double rgb_total = rgb_totals[chunk_index + k];
 				const int num_px = num_ref_px[chunk_index / bpp];
-				new_image[index + k] = static_cast<int>(round(static_cast<double>(rgb_total) / num_px));
+				new_row[index + k] = to_sample<T>(rgb_total / num_px);
 			}
 		}
 	}
+}
 
-	// Delete arrays from dynamic memory
-	delete[] rgb_totals;
-	delete[] num_ref_px;
 
-	return new ImageMatrix(new_image, new_width, new_height, bpp);
+void Pixelator::write(const ImageMatrix& rows, const int& first, const int& count) {
+	if (bpp == 0) {
+		bpp = rows.getBpp();
+		sample_type = rows.getSampleType();
+		rgb_totals.assign(num_ref_px.size() * bpp, 0.0);
+	}
+	switch (sample_type) {
+		case SampleType::U16:
+			add_samples<uint16_t>(rows, first, count);
+			break;
+		case SampleType::F32:
+			add_samples<float>(rows, first, count);
+			break;
+		default:
+			add_samples<uint8_t>(rows, first, count);
+	}
 }
 
 
-string ascii(const ImageMatrix& image, const int& cols, const double& ratio) {
-	const int width = image.getWidth();
-	const int height = image.getHeight();
-	const int bpp = image.getBpp();
+void Pixelator::read(ImageMatrix& rows, const int& first, const int& count) {
+	switch (sample_type) {
+		case SampleType::U16:
+			fill_samples<uint16_t>(rows, first, count);
+			break;
+		case SampleType::F32:
+			fill_samples<float>(rows, first, count);
+			break;
+		default:
+			fill_samples<uint8_t>(rows, first, count);
+	}
+}
+
+
+ImageMatrix* pixelate(const ImageMatrix& image, const int& divs) {
+	Pixelator pixelator(image.getWidth(), image.getHeight(), divs);
+	pixelator.write(image, 0, image.getHeight());
+	auto* new_image = new ImageMatrix(pixelator.getWidth(), pixelator.getHeight(), image.getBpp(), 0,
+		image.getSampleType());
+	pixelator.read(*new_image, 0, new_image->getHeight());
+	return new_image;
+}
+
+
+AsciiRenderer::AsciiRenderer(const int& width, const int& height, const int& cols, const double& ratio) {
+	this->width = width;
+	this->height = height;
+	this->cols = cols;
 
 	// Determine new image info
 	const double chunk_width = static_cast<double>(width) / cols;	// Divisions on the width
-	const int chunks = max(1, static_cast<int>(round(width / chunk_width) * round(height / chunk_width)));
-	const int rows = max(1, static_cast<int>(round(height / chunk_width / ratio)));
+	rows = max(1, static_cast<int>(round(height / chunk_width / ratio)));
 	const double chunk_height = static_cast<double>(height) / rows;
 
-	// Create bit data for new image
-	const auto rgb_totals = new int[chunks * bpp]();	// Parentheses initialize all elements with 0
-	const auto num_ref_px = new int[chunks]();	// Number of reference pixels in each destination chunk
+	// Map every pixel column and row to the chunk it belongs to
+	chunk_cols.resize(width);
+	for (int j = 0; j < width; j++) {
+		chunk_cols[j] = static_cast<int>(floor((j + j + 1) / 2.0 / chunk_width));
+	}
+	chunk_rows.resize(height);
+	for (int i = 0; i < height; i++) {
+		chunk_rows[i] = static_cast<int>(floor((i + i + 1) / 2.0 / chunk_height));
+	}
+
+	// The number of reference pixels in each chunk only depends on the frame size
+	totals.assign(rows * cols, 0);
+	num_ref_px.assign(rows * cols, 0);
 	for (int i = 0; i < height; i++) {
 		for (int j = 0; j < width; j++) {
-			// Index of pixel in original image
-			const int index = bpp * (j + i * width);
-			// Index of pixel in pixelated image
-			const int chunk_col = floor((j + j + 1) / 2.0 / chunk_width);
-			const int chunk_row = floor((i + i + 1) / 2.0 / chunk_height);
-			const int chunk_index = bpp * (chunk_col + chunk_row * cols);
-			// Add RGB values
-			for (int k = 0; k < bpp; k++) {
-				rgb_totals[chunk_index + k] += image.getImageData()[index + k];
+			num_ref_px[chunk_cols[j] + chunk_rows[i] * cols]++;
+		}
+	}
+	ascii_str.reserve((cols + 1) * rows);
+}
+
+
+const string& AsciiRenderer::render(const uint8_t* data, const int& stride, const int& bpp) {
+	const int channels = color_channels(bpp);
+
+	// Sum the channel values of every chunk
+	fill(totals.begin(), totals.end(), 0);
+	for (int i = 0; i < height; i++) {
+		const uint8_t* row = data + static_cast<size_t>(i) * stride;
+		int* row_totals = &totals[chunk_rows[i] * cols];
+		if (channels == 3) {
+			for (int j = 0; j < width; j++) {
+				const uint8_t* pixel = row + j * bpp;
+				row_totals[chunk_cols[j]] += pixel[0] + pixel[1] + pixel[2];
+			}
+		}
+		else {
+			for (int j = 0; j < width; j++) {
+				row_totals[chunk_cols[j]] += row[j * bpp];
 			}
-			num_ref_px[chunk_index / bpp]++;
 		}
 	}
-	string ascii_str;
+
+	ascii_str.clear();
 	for (int i = 0; i < rows; i++) {
 		for (int j = 0; j < cols; j++) {
 			// Index of pixel in pixelated image
-			const int chunk_index = bpp * (j + i * cols);
-			// Find average RGB value in chunk to find its brightness
-			const int brightness = static_cast<int>(1.0 * (
-					rgb_totals[chunk_index]
-					+ rgb_totals[chunk_index + 1]
-					+ rgb_totals[chunk_index + 2] )
-				/ num_ref_px[chunk_index / bpp] / 3);
+			const int chunk_index = j + i * cols;
+			// Find average value in chunk to find its brightness
+			const int brightness = num_ref_px[chunk_index] == 0 ? 0 : static_cast<int>(
+				1.0 * totals[chunk_index] / num_ref_px[chunk_index] / channels);
 			// Add an ASCII character to the string corresponding to the brightness
 			const int char_index = static_cast<int>(brightness / 255.0 * (ASCII_CHARS.size() - 1));
 			ascii_str += ASCII_CHARS[char_index];
@@ -121,54 +189,68 @@ string ascii(const ImageMatrix& image, const int& cols, const double& ratio) {
 		// Add new line
 		ascii_str += "\n";
 	}
+	return ascii_str;
+}
 
-	// Delete arrays from dynamic memory
-	delete[] rgb_totals;
-	delete[] num_ref_px;
 
-	return ascii_str;
+string ascii(const ImageMatrix& image, const int& cols, const double& ratio) {
+	const int width = image.getWidth();
+	const int height = image.getHeight();
+	const int bpp = image.getBpp();
+	AsciiRenderer renderer(width, height, cols, ratio);
+	if (image.getSampleType() != SampleType::U8) {
+		// Characters only have a few levels, so 8-bit samples are plenty
+		const ImageMatrix* bytes = image.converted(SampleType::U8);
+		const string text = renderer.render(bytes->getImageData(), bytes->getStride(), bpp);
+		delete bytes;
+		return text;
+	}
+	return renderer.render(image.getImageData(), image.getStride(), bpp);
 }
 
 
-ImageMatrix* outline(const ImageMatrix& image) {
-	constexpr double kernel[] = {
+ImageMatrix* outline(const ImageMatrix& image, const BorderMode& border) {
+	return stencil<
 		-1,	-1,	-1,
 		-1,	8,	-1,
 		-1,	-1,	-1
-	};
-	return image.convolve(kernel, sizeof(kernel)/sizeof(kernel[0]));
+	>(image, border);
 }
 
 
-ImageMatrix* sharpen(const ImageMatrix& image) {
-	constexpr double kernel[] = {
+ImageMatrix* sharpen(const ImageMatrix& image, const BorderMode& border) {
+	return stencil<
 		0,	-1,	0,
 		-1,	5,	-1,
 		0,	-1,	0
-	};
-	return image.convolve(kernel, sizeof(kernel)/sizeof(kernel[0]));
+	>(image, border);
 }
 
 
-ImageMatrix* contrast(const ImageMatrix& image, const int& value) {
+vector<double> contrast_matrix(const int& value) {
 	const double factor = (259.0 * (value + 255)) / (255 * (259 - value));
-	const double matrix[] = {
+	return {
 		factor,	0,		0,		128 - factor*128,
 		0,		factor,	0,		128 - factor*128,
 		0,		0,		factor,	128 - factor*128
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* box_blur(const ImageMatrix& image, const int& radius) {
+ImageMatrix* contrast(const ImageMatrix& image, const int& value) {
+	return image.filter(contrast_matrix(value).data());
+}
+
+
+ImageMatrix* box_blur(const ImageMatrix& image, const int& radius, const BorderMode& border) {
 	const int kernel_size = static_cast<int>(pow(2 * radius + 1, 2));
 	vector<double> kernel(kernel_size, 1);
-	return image.convolve(&kernel[0], kernel_size, 1.0/kernel_size);
+	return image.convolve(&kernel[0], kernel_size, 1.0/kernel_size, border);
 }
 
 
-ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const double& sigma) {
+ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const double& sigma,
+	const BorderMode& border) {
 	const int kernel_size = static_cast<int>(pow(2 * radius + 1, 2));
 	const int kernel_rows = 2*radius + 1;
 	vector<double> kernel(kernel_size, 0);
@@ -183,74 +265,213 @@ ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const do
 	for (int i = 0; i < kernel_size; i++) {
 		sum += kernel[i];
 	}
-	return image.convolve(&kernel[0], kernel_size, 1.0/sum);
+	return image.convolve(&kernel[0], kernel_size, 1.0/sum, border);
 }
 
 
-ImageMatrix* grayscale(const ImageMatrix& image) {
-	constexpr double matrix[] = {
+bool parse_kernel(const string& text, vector<double>& kernel) {
+	// Drop comments and turn every separator into a line break or a space
+	string cleaned;
+	bool comment = false;
+	for (const char c : text) {
+		comment = c == '#' || (comment && c != '\n');
+		cleaned += comment ? ' ' : c == ';' ? '\n' : c == ',' ? ' ' : c;
+	}
+	kernel.clear();
+	size_t kernel_rows = 0;
+	size_t columns = 0;
+	istringstream lines(cleaned);
+	string line;
+	while (getline(lines, line)) {
+		istringstream entries(line);
+		size_t count = 0;
+		double entry;
+		while (entries >> entry) {
+			kernel.push_back(entry);
+			count++;
+		}
+		if (!entries.eof()) {
+			return false;
+		}
+		if (count == 0) {
+			continue;
+		}
+		if (kernel_rows > 0 && count != columns) {
+			return false;
+		}
+		columns = count;
+		kernel_rows++;
+	}
+	return kernel_rows > 0 && kernel_rows == columns && kernel_rows % 2 == 1;
+}
+
+
+double kernel_scalar(const vector<double>& kernel, const double& scale, const bool& normalize) {
+	double scalar = scale;
+	if (normalize) {
+		double sum = 0;
+		for (const double entry : kernel) {
+			sum += entry;
+		}
+		if (sum != 0) {
+			scalar /= sum;
+		}
+	}
+	return scalar;
+}
+
+
+ImageMatrix* convolve_kernel(const ImageMatrix& image, const vector<double>& kernel, const double& scale,
+	const bool& normalize, const BorderMode& border) {
+	return image.convolve(&kernel[0], kernel.size(), kernel_scalar(kernel, scale, normalize), border);
+}
+
+
+vector<double> grayscale_matrix() {
+	return {
 		1.0/3.0,	1.0/3.0,	1.0/3.0,	0,
 		1.0/3.0,	1.0/3.0,	1.0/3.0,	0,
 		1.0/3.0,	1.0/3.0,	1.0/3.0,	0
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* invert(const ImageMatrix& image) {
-	constexpr double matrix[] = {
+ImageMatrix* grayscale(const ImageMatrix& image) {
+	return image.filter(grayscale_matrix().data());
+}
+
+
+/**
+ * Returns the luminance of an RGB pixel
+ * @param pixel The red, green and blue samples
+ * @return The luminance sample
+*/
+template <typename T>
+inline T luma(const T* pixel) {
+	return to_sample<T>((LUMA_RED * pixel[0] + LUMA_GREEN * pixel[1] + LUMA_BLUE * pixel[2]) / 256.0);
+}
+
+template <>
+inline uint8_t luma<uint8_t>(const uint8_t* pixel) {
+	// The weights add up to 256, so the result never exceeds 255
+	return static_cast<uint8_t>((LUMA_RED * pixel[0] + LUMA_GREEN * pixel[1] + LUMA_BLUE * pixel[2] + 128) >> 8);
+}
+
+
+/**
+ * Reduces an image with any sample type to its luminance
+ * @param image The image
+ * @return The output image, with one channel or gray with alpha
+*/
+template <typename T>
+ImageMatrix* luminance_samples(const ImageMatrix& image) {
+	const int width = image.getWidth();
+	const int height = image.getHeight();
+	const int bpp = image.getBpp();
+	const bool alpha = has_alpha(bpp);
+	auto* new_image = new ImageMatrix(width, height, alpha ? 2 : 1, 0, image.getSampleType());
+	const int new_bpp = new_image->getBpp();
+	for (int i = 0; i < height; i++) {
+		const T* row = image.getSamples<T>(i);
+		T* new_row = new_image->getSamples<T>(i);
+		for (int j = 0; j < width; j++) {
+			const T* pixel = row + j * bpp;
+			new_row[j * new_bpp] = bpp >= 3 ? luma(pixel) : pixel[0];
+			if (alpha) {
+				new_row[j * new_bpp + 1] = pixel[bpp - 1];
+			}
+		}
+	}
+	return new_image;
+}
+
+
+ImageMatrix* luminance(const ImageMatrix& image) {
+	switch (image.getSampleType()) {
+		case SampleType::U16:
+			return luminance_samples<uint16_t>(image);
+		case SampleType::F32:
+			return luminance_samples<float>(image);
+		default:
+			return luminance_samples<uint8_t>(image);
+	}
+}
+
+
+vector<double> invert_matrix() {
+	return {
 		-1,		0,		0,	255,
 		0,		-1,		0,	255,
 		0,		0,		-1,	255
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* sepia(const ImageMatrix& image) {
-	constexpr double matrix[] = {
+ImageMatrix* invert(const ImageMatrix& image) {
+	return image.filter(invert_matrix().data());
+}
+
+
+vector<double> sepia_matrix() {
+	return {
 		0.393,	0.769,	0.189,	0,
 		0.349,	0.686,	0.168,	0,
 		0.272,	0.534,	0.131,	0
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* enable_channels(const ImageMatrix& image, const bool& r_on, const bool& g_on, const bool& b_on) {
+ImageMatrix* sepia(const ImageMatrix& image) {
+	return image.filter(sepia_matrix().data());
+}
+
+
+vector<double> enable_channels_matrix(const bool& r_on, const bool& g_on, const bool& b_on) {
 	const double r_bit = r_on ? 1 : 0;
 	const double g_bit = g_on ? 1 : 0;
 	const double b_bit = b_on ? 1 : 0;
-	const double matrix[] = {
+	return {
 		r_bit,	0,		0,		0,
 		0,		g_bit,	0,		0,
 		0,		0,		b_bit,	0
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* color(const ImageMatrix& image, const string& hex) {
+ImageMatrix* enable_channels(const ImageMatrix& image, const bool& r_on, const bool& g_on, const bool& b_on) {
+	return image.filter(enable_channels_matrix(r_on, g_on, b_on).data());
+}
+
+
+vector<double> color_matrix(const string& hex) {
 	const double r_frac = static_cast<float>(static_cast<uint8_t>(
 		stoul(hex.substr(0, 2), nullptr, 16)) / 255.0);
 	const double g_frac = static_cast<float>(static_cast<uint8_t>(
 		stoul(hex.substr(2, 2), nullptr, 16)) / 255.0);
 	const double b_frac = static_cast<float>(static_cast<uint8_t>(
 		stoul(hex.substr(4, 2), nullptr, 16)) / 255.0);
-	const double matrix[] = {
+	return {
 		r_frac/3.0,	r_frac/3.0,	r_frac/3.0,	0,
 		g_frac/3.0,	g_frac/3.0,	g_frac/3.0,	0,
 		b_frac/3.0,	b_frac/3.0,	b_frac/3.0,	0
 	};
-	return image.filter(matrix);
 }
 
 
-ImageMatrix* octopus_dragon(const ImageMatrix& image) {
-	constexpr double matrix[] = {
+ImageMatrix* color(const ImageMatrix& image, const string& hex) {
+	return image.filter(color_matrix(hex).data());
+}
+
+
+vector<double> octopus_dragon_matrix() {
+	return {
 		0.807,	0.162,	0.039,	0,
 		0.119,	0.194,	0.633,	0,
 		0.0,	0.050,	0.900,	0
 	};
-	return image.filter(matrix);
-}
\ No newline at end of file
+}
+
+
+ImageMatrix* octopus_dragon(const ImageMatrix& image) {
+	return image.filter(octopus_dragon_matrix().data());
+}
@@ -1,7 +1,93 @@
 #ifndef IMAGE_FUNCTIONS_H
 #define IMAGE_FUNCTIONS_H
 
+#include "pipeline.h"
 #include "util.h"
+#include <vector>
+
+/**
+ * Renders frames of a fixed size into ASCII art. All buffers are allocated once
+ * and reused, so a renderer can be kept around to draw a stream of frames.
+*/
+class AsciiRenderer {
+	int width;	// The width of the frames
+	int height;	// The height of the frames
+	int cols;	// The number of characters along the width
+	int rows;	// The number of characters along the height
+	std::vector<int> chunk_cols;	// The chunk column of each pixel column
+	std::vector<int> chunk_rows;	// The chunk row of each pixel row
+	std::vector<int> totals;	// Sum of the channel values in each chunk
+	std::vector<int> num_ref_px;	// Number of reference pixels in each chunk
+	std::string ascii_str;	// The output text
+
+public:
+	/**
+	 * Creates a renderer for frames of the given size
+	 * @param width The width of the frames
+	 * @param height The height of the frames
+	 * @param cols The number of characters along the width
+	 * @param ratio The width/height ratio to stretch the image by
+	 */
+	AsciiRenderer(const int& width, const int& height, const int& cols, const double& ratio);
+
+	int getCols() const { return cols; }
+	int getRows() const { return rows; }
+
+	/**
+	 * Renders a frame. Frames with one or two bytes per pixel are treated as luma,
+	 * otherwise the average of the RGB components is used.
+	 * @param data The pixel data of the frame
+	 * @param stride The number of bytes between the starts of two rows
+	 * @param bpp Bytes per pixel
+	 * @return The output text, valid until the next call
+	 */
+	const std::string& render(const std::uint8_t* data, const int& stride, const int& bpp);
+};
+
+
+/**
+ * Pixelates an image one band of rows at a time. The rows written are added to the totals
+ * of the chunks they fall in, and once every row is written, the rows read are filled with
+ * the averages of their chunks. Only the totals are kept, so the whole image never has to
+ * be in memory.
+*/
+class Pixelator : public ResampleStage {
+	int width;	// The width of the input image
+	int height;	// The height of the input image
+	int width_pixels;	// The number of chunks along the width
+	int height_pixels;	// The number of chunks along the height
+	double chunk_width;	// The width of a chunk in input pixels
+	double chunk_height;	// The height of a chunk in input pixels
+	int new_width;	// The width of the output image
+	int new_height;	// The height of the output image
+	int bpp;	// Channels per pixel, known from the first row written
+	SampleType sample_type;	// The sample type, known from the first row written
+	std::vector<double> rgb_totals;	// Sum of the samples of each channel in each chunk
+	std::vector<int> num_ref_px;	// Number of input pixels in each chunk
+	int next_in;	// The next input row to write
+	int next_out;	// The next output row to read
+
+	template <typename T> void add_samples(const ImageMatrix& rows, const int& first, const int& count);
+	template <typename T> void fill_samples(ImageMatrix& rows, const int& first, const int& count);
+
+public:
+	/**
+	 * Creates a pixelator for an image of the given size
+	 * @param width The width of the image
+	 * @param height The height of the image
+	 * @param divs The number of times the image will be divided on the longest side
+	 */
+	Pixelator(const int& width, const int& height, const int& divs);
+
+	int getWidth() const override { return new_width; }
+	int getHeight() const override { return new_height; }
+	int getBpp() const override { return bpp; }
+	SampleType getSampleType() const override { return sample_type; }
+
+	void write(const ImageMatrix& rows, const int& first, const int& count) override;
+	void read(ImageMatrix& rows, const int& first, const int& count) override;
+};
+
 
 /**
  * Transforms an image into a pixelated version of itself.
@@ -25,17 +111,19 @@ std::string ascii(const ImageMatrix& image, const int& cols, const double& ratio
 /**
  * Highlights large differences in pixel values
  * @param image The image
+ * @param border Determines the values of pixels outside of the image
  * @return The output image
  */
-ImageMatrix* outline(const ImageMatrix& image);
+ImageMatrix* outline(const ImageMatrix& image, const BorderMode& border);
 
 
 /**
  * Emphasizes differences in adjacent pixel values
  * @param image The image
+ * @param border Determines the values of pixels outside of the image
  * @return The output image
  */
-ImageMatrix* sharpen(const ImageMatrix& image);
+ImageMatrix* sharpen(const ImageMatrix& image, const BorderMode& border);
 
 
 /**
@@ -47,13 +135,22 @@ ImageMatrix* sharpen(const ImageMatrix& image);
 ImageMatrix* contrast(const ImageMatrix& image, const int& value);
 
 
+/**
+ * Returns the filter matrix of contrast
+ * @param value The contrast value (-255 - 255)
+ * @return The filter matrix
+ */
+std::vector<double> contrast_matrix(const int& value);
+
+
 /**
  * Averages each pixel's value with the value of its neighboring pixels
  * @param image The image
  * @param radius 2 * radius + 1 = Width and height of the kernel
+ * @param border Determines the values of pixels outside of the image
  * @return The output image
  */
-ImageMatrix* box_blur(const ImageMatrix& image, const int& radius);
+ImageMatrix* box_blur(const ImageMatrix& image, const int& radius, const BorderMode& border);
 
 
 /**
@@ -61,9 +158,45 @@ ImageMatrix* box_blur(const ImageMatrix& image, const int& radius);
  * @param image The image
  * @param radius 2 * radius + 1 = Width and height of the kernel
  * @param sigma The standard deviation of the Gaussian distribution
+ * @param border Determines the values of pixels outside of the image
+ * @return The output image
+ */
+ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const double& sigma,
+	const BorderMode& border);
+
+
+/**
+ * Reads a square kernel with an odd number of rows from text. Rows are separated by
+ * semicolons or line breaks, entries by commas or whitespace, and '#' starts a comment.
+ * @param text The text
+ * @param kernel Overridden with the kernel matrix
+ * @return Whether the text holds a valid kernel
+ */
+bool parse_kernel(const std::string& text, std::vector<double>& kernel);
+
+
+/**
+ * Returns the scalar a user-defined kernel is multiplied by
+ * @param kernel The kernel matrix
+ * @param scale A scalar by which to multiply the kernel
+ * @param normalize Whether to divide the kernel by the sum of its entries, unless it is zero
+ * @return The scalar
+ */
+double kernel_scalar(const std::vector<double>& kernel, const double& scale, const bool& normalize);
+
+
+/**
+ * Convolves the image with a user-defined kernel, after analyzing its shape to pick the
+ * cheapest way to evaluate it
+ * @param image The image
+ * @param kernel The kernel matrix
+ * @param scale A scalar by which to multiply the kernel
+ * @param normalize Whether to divide the kernel by the sum of its entries
+ * @param border Determines the values of pixels outside of the image
  * @return The output image
  */
-ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const double& sigma);
+ImageMatrix* convolve_kernel(const ImageMatrix& image, const std::vector<double>& kernel, const double& scale,
+	const bool& normalize, const BorderMode& border);
 
 
 /**
@@ -74,6 +207,22 @@ ImageMatrix* gaussian_blur(const ImageMatrix& image, const int& radius, const do
 ImageMatrix* grayscale(const ImageMatrix& image);
 
 
+/**
+ * Returns the filter matrix of grayscale
+ * @return The filter matrix
+*/
+std::vector<double> grayscale_matrix();
+
+
+/**
+ * Converts the image to a single gray channel weighted by luminance, in integer
+ * arithmetic. Alpha is kept as a second channel.
+ * @param image The image
+ * @return The output image, with one byte per pixel (two with alpha)
+*/
+ImageMatrix* luminance(const ImageMatrix& image);
+
+
 /**
  * Inverts the colors of the image
  * @param image The image
@@ -82,6 +231,13 @@ ImageMatrix* grayscale(const ImageMatrix& image);
 ImageMatrix* invert(const ImageMatrix& image);
 
 
+/**
+ * Returns the filter matrix of invert
+ * @return The filter matrix
+*/
+std::vector<double> invert_matrix();
+
+
 /**
  * Adds a warm brown tone to the image
  * @param image The image
@@ -90,6 +246,13 @@ ImageMatrix* invert(const ImageMatrix& image);
 ImageMatrix* sepia(const ImageMatrix& image);
 
 
+/**
+ * Returns the filter matrix of sepia
+ * @return The filter matrix
+*/
+std::vector<double> sepia_matrix();
+
+
 /**
  * Enables and disables particular channels in an image
  * @param image The image
@@ -101,6 +264,16 @@ ImageMatrix* sepia(const ImageMatrix& image);
 ImageMatrix* enable_channels(const ImageMatrix& image, const bool& r_on, const bool& g_on, const bool& b_on);
 
 
+/**
+ * Returns the filter matrix of enable_channels
+ * @param r_on Whether the red channel is enabled
+ * @param g_on Whether the green channel is enabled
+ * @param b_on Whether the blue channel is enabled
+ * @return The filter matrix
+ */
+std::vector<double> enable_channels_matrix(const bool& r_on, const bool& g_on, const bool& b_on);
+
+
 /**
  * Replaces all existing color with the corresponding shade of a new color
  * @param image The image
@@ -110,6 +283,14 @@ ImageMatrix* enable_channels(const ImageMatrix& image, const bool& r_on, const b
 ImageMatrix* color(const ImageMatrix& image, const std::string& hex);
 
 
+/**
+ * Returns the filter matrix of color
+ * @param hex The desired color as a hexidecimal value
+ * @return The filter matrix
+ */
+std::vector<double> color_matrix(const std::string& hex);
+
+
 /**
  * Shifts the colors to mix of blue and orange tones
  * @param image The image
@@ -118,4 +299,11 @@ ImageMatrix* color(const ImageMatrix& image, const std::string& hex);
 ImageMatrix* octopus_dragon(const ImageMatrix& image);
 
 
+/**
+ * Returns the filter matrix of octopus_dragon
+ * @return The filter matrix
+ */
+std::vector<double> octopus_dragon_matrix();
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,634 @@
+#include "image_io.h"
+#include "tiled_image.h"
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+using namespace std;
+
+
+constexpr int BMP_FILE_HEADER_SIZE = 14;	// Size of the header in front of the bitmap header
+constexpr int BMP_INFO_HEADER_SIZE = 40;	// Size of the bitmap header of 24-bit files
+constexpr int BMP_V4_HEADER_SIZE = 108;	// Size of the bitmap header of files with an alpha mask
+constexpr int BMP_MAX_HEADER_SIZE = 124;	// Size of the largest bitmap header (V5)
+constexpr uint32_t BMP_BITFIELDS = 3;	// Compression of files whose channels are given by masks
+
+const uint32_t BMP_MASKS[4] = { 0xff0000, 0xff00, 0xff, 0xff000000 };	// Channel masks of 32-bit BGRA files
+
+
+namespace {
+
+/**
+ * Reports an image that cannot be decoded and exits
+ * @param path The path of the image
+ */
+[[noreturn]] void read_failed(const string& path) {
+	cout << "Could not read image: " << path << endl;
+	exit(2);
+}
+
+
+/**
+ * Reports an image that cannot be encoded and exits
+ * @param path The path of the image
+ */
+[[noreturn]] void write_failed(const string& path) {
+	cout << "Could not write image: " << path << endl;
+	exit(2);
+}
+
+
+/**
+ * Returns the lowercase extension of a path
+ */
+string extension(const string& path) {
+	string ext = path.substr(path.find_last_of('.') + 1);
+	for (char& c : ext) {
+		c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	}
+	return ext;
+}
+
+
+bool is_pnm(const string& ext) {
+	return ext == "ppm" || ext == "pgm" || ext == "pnm";
+}
+
+
+/**
+ * Decodes a little-endian number
+ * @param bytes The bytes, least significant first
+ * @param count The number of bytes
+ */
+uint32_t little_endian(const uint8_t* bytes, const int& count) {
+	uint32_t value = 0;
+	for (int i = count - 1; i >= 0; i--) {
+		value = value << 8 | bytes[i];
+	}
+	return value;
+}
+
+
+/**
+ * Appends a little-endian number
+ * @param bytes The bytes to append to
+ * @param value The number
+ * @param count The number of bytes
+ */
+void put_little_endian(vector<uint8_t>& bytes, const uint32_t& value, const int& count) {
+	for (int i = 0; i < count; i++) {
+		bytes.push_back(static_cast<uint8_t>(value >> (i * 8)));
+	}
+}
+
+
+/**
+ * Quantizes a band of rows to 8-bit samples, unless they already are
+ * @param rows The band of rows
+ * @param first_row The row of the image that is the first row of the band
+ * @param dithered Whether wider samples are dithered instead of rounded
+ * @return The 8-bit rows, or null if the rows are 8-bit
+ */
+ImageMatrix* quantized(const ImageMatrix& rows, const int& first_row, const bool& dithered) {
+	if (rows.getSampleType() == SampleType::U8) {
+		return nullptr;
+	}
+	return dithered ? dither(rows, first_row) : rows.converted(SampleType::U8);
+}
+
+
+/**
+ * Reads the rows of an image that was decoded whole
+ */
+class DecodedReader : public RowReader {
+	unique_ptr<ImageMatrix> image;	// The image
+	MatrixReader rows;	// Reads the rows of the image
+
+public:
+	explicit DecodedReader(ImageMatrix* image) : image(image), rows(*image) {}
+
+	int getWidth() const override { return image->getWidth(); }
+	int getHeight() const override { return image->getHeight(); }
+	int getBpp() const override { return image->getBpp(); }
+	SampleType getSampleType() const override { return image->getSampleType(); }
+
+	void read(ImageMatrix& band, const int& first, const int& count) override {
+		rows.read(band, first, count);
+	}
+};
+
+
+/**
+ * Decodes the rows of a binary PGM (P5) or PPM (P6) file as they are read. Samples are
+ * 8-bit up to a maximum value of 255 and 16-bit above it, scaled to the full range.
+ */
+class PnmReader : public RowReader {
+	string path;	// The path of the image
+	FILE* file;	// The file, positioned at the next row
+	int width;	// The width of the image
+	int height;	// The height of the image
+	int bpp;	// 1 for PGM, 3 for PPM
+	int max_value;	// The sample value that stands for full intensity
+	vector<uint8_t> line;	// The bytes of one row in the file
+
+	/**
+	 * Reads a number of the header, skipping whitespace and comments in front of it. The
+	 * single whitespace character that ends the number is consumed.
+	 */
+	int read_number() {
+		int c = fgetc(file);
+		while (c == '#' || isspace(c)) {
+			if (c == '#') {
+				while (c != EOF && c != '\n' && c != '\r') {
+					c = fgetc(file);
+				}
+			}
+			c = fgetc(file);
+		}
+		long value = 0;
+		if (!isdigit(c)) {
+			read_failed(path);
+		}
+		for (; isdigit(c); c = fgetc(file)) {
+			value = value * 10 + (c - '0');
+			if (value > 1 << 30) {
+				read_failed(path);
+			}
+		}
+		return static_cast<int>(value);
+	}
+
+public:
+	explicit PnmReader(const string& path) : path(path), file(fopen(path.c_str(), "rb")) {
+		if (file == nullptr || fgetc(file) != 'P') {
+			read_failed(path);
+		}
+		const int type = fgetc(file);
+		if (type != '5' && type != '6') {
+			read_failed(path);
+		}
+		bpp = type == '6' ? 3 : 1;
+		width = read_number();
+		height = read_number();
+		max_value = read_number();
+		if (width == 0 || height == 0 || max_value == 0 || max_value > 65535) {
+			read_failed(path);
+		}
+		line.resize(static_cast<size_t>(width) * bpp * (max_value > 255 ? 2 : 1));
+	}
+
+	PnmReader(const PnmReader& reader) = delete;
+	PnmReader& operator=(const PnmReader& reader) = delete;
+	~PnmReader() override { fclose(file); }
+
+	int getWidth() const override { return width; }
+	int getHeight() const override { return height; }
+	int getBpp() const override { return bpp; }
+	SampleType getSampleType() const override { return max_value > 255 ? SampleType::U16 : SampleType::U8; }
+
+	void read(ImageMatrix& rows, const int& first, const int& count) override {
+		const int samples = width * bpp;
+		for (int i = 0; i < count; i++) {
+			if (fread(&line[0], 1, line.size(), file) != line.size()) {
+				read_failed(path);
+			}
+			if (max_value > 255) {
+				// Samples are stored most significant byte first
+				auto* row = rows.getSamples<uint16_t>(first + i);
+				for (int j = 0; j < samples; j++) {
+					const int value = line[j * 2] << 8 | line[j * 2 + 1];
+					row[j] = max_value == 65535 ? value : to_sample<uint16_t>(value * 65535.0 / max_value);
+				}
+			}
+			else {
+				uint8_t* row = rows.getRow(first + i);
+				for (int j = 0; j < samples; j++) {
+					row[j] = max_value == 255 ? line[j] : clamp_round(line[j] * 255.0 / max_value);
+				}
+			}
+		}
+	}
+};
+
+
+/**
+ * Decodes the rows of an uncompressed 24-bit BMP file, or of a 32-bit one with an alpha
+ * mask, as they are read. Files stored bottom-up are read from the end.
+ */
+class BmpReader : public RowReader {
+	string path;	// The path of the image
+	FILE* file;	// The file
+	int width;	// The width of the image
+	int height;	// The height of the image
+	int bpp;	// 3 for 24-bit files, 4 for 32-bit ones
+	uint64_t pixel_offset;	// Position of the pixels in the file
+	bool top_down;	// Whether the first row in the file is the top row of the image
+	int next;	// The next row to read
+	vector<uint8_t> line;	// The bytes of one row in the file, padded to 4 bytes
+
+public:
+	/**
+	 * Reads the header of a BMP file
+	 * @param path The path of the image
+	 * @param file The file, positioned at its start; the reader closes it
+	 */
+	BmpReader(const string& path, FILE* file) : path(path), file(file), bpp(0), next(0) {
+		uint8_t header[BMP_FILE_HEADER_SIZE + BMP_MAX_HEADER_SIZE];
+		if (fread(header, 1, BMP_FILE_HEADER_SIZE + 4, file) != BMP_FILE_HEADER_SIZE + 4
+			|| header[0] != 'B' || header[1] != 'M') {
+			return;
+		}
+		pixel_offset = little_endian(header + 10, 4);
+		const uint8_t* info = header + BMP_FILE_HEADER_SIZE;
+		const uint32_t info_size = little_endian(info, 4);
+		if (info_size != 40 && info_size != 56 && info_size != 108 && info_size != 124) {
+			return;
+		}
+		if (fread(header + BMP_FILE_HEADER_SIZE + 4, 1, info_size - 4, file) != info_size - 4) {
+			return;
+		}
+		width = static_cast<int32_t>(little_endian(info + 4, 4));
+		const int32_t rows = static_cast<int32_t>(little_endian(info + 8, 4));
+		const uint32_t bits = little_endian(info + 14, 2);
+		const uint32_t compression = little_endian(info + 16, 4);
+		// A top-down height of INT32_MIN has no positive counterpart
+		if (width <= 0 || rows == 0 || rows == INT32_MIN || little_endian(info + 12, 2) != 1) {
+			return;
+		}
+		top_down = rows < 0;
+		height = top_down ? -rows : rows;
+		if (bits == 24 && compression == 0) {
+			bpp = 3;
+		}
+		else if (bits == 32 && compression == BMP_BITFIELDS && info_size >= BMP_V4_HEADER_SIZE) {
+			bpp = 4;
+			for (int c = 0; c < 4; c++) {
+				if (little_endian(info + 40 + c * 4, 4) != BMP_MASKS[c]) {
+					bpp = 0;
+				}
+			}
+		}
+		line.resize((static_cast<size_t>(width) * bpp + 3) / 4 * 4);
+	}
+
+	BmpReader(const BmpReader& reader) = delete;
+	BmpReader& operator=(const BmpReader& reader) = delete;
+	~BmpReader() override { fclose(file); }
+
+	/**
+	 * Checks whether the file is a kind of BMP file that is decoded row by row
+	 */
+	bool supported() const { return bpp != 0; }
+
+	int getWidth() const override { return width; }
+	int getHeight() const override { return height; }
+	int getBpp() const override { return bpp; }
+	SampleType getSampleType() const override { return SampleType::U8; }
+
+	void read(ImageMatrix& rows, const int& first, const int& count) override {
+		for (int i = 0; i < count; i++, next++) {
+			const uint64_t position = pixel_offset + line.size() * static_cast<uint64_t>(top_down ? next : height - 1 - next);
+			if (!seek_file(file, position) || fread(&line[0], 1, line.size(), file) != line.size()) {
+				read_failed(path);
+			}
+			// Pixels are stored as BGR or BGRA
+			uint8_t* row = rows.getRow(first + i);
+			for (int j = 0; j < width; j++) {
+				const uint8_t* pixel = &line[static_cast<size_t>(j) * bpp];
+				row[j * bpp] = pixel[2];
+				row[j * bpp + 1] = pixel[1];
+				row[j * bpp + 2] = pixel[0];
+				if (bpp == 4) {
+					row[j * bpp + 3] = pixel[3];
+				}
+			}
+		}
+	}
+};
+
+
+/**
+ * Encodes rows into a binary PGM or PPM file as they are written. Alpha is dropped, since
+ * the format has none; 16-bit images keep their samples.
+ */
+class PnmWriter : public RowWriter {
+	string path;	// The path of the image
+	int height;	// The height of the image
+	bool dithered;	// Whether wider samples are dithered instead of rounded
+	FILE* file;	// The file, or null before the first write
+	int next;	// The next row to write
+
+public:
+	PnmWriter(const string& path, const int& height, const bool& dithered) :
+		path(path), height(height), dithered(dithered), file(nullptr), next(0) {}
+	PnmWriter(const PnmWriter& writer) = delete;
+	PnmWriter& operator=(const PnmWriter& writer) = delete;
+	~PnmWriter() override {
+		if (file != nullptr) {
+			fclose(file);
+		}
+	}
+
+	void write(const ImageMatrix& rows, const int& first, const int& count) override {
+		const bool wide = rows.getSampleType() == SampleType::U16;
+		const int bpp = rows.getBpp();
+		const int channels = bpp < 3 ? 1 : 3;
+		if (file == nullptr) {
+			file = fopen(path.c_str(), "wb");
+			if (file == nullptr || fprintf(file, "P%c\n%d %d\n%d\n", channels == 3 ? '6' : '5',
+				rows.getWidth(), height, wide ? 65535 : 255) < 0) {
+				write_failed(path);
+			}
+		}
+		unique_ptr<ImageMatrix> samples(wide ? nullptr : quantized(rows, next - first, dithered));
+		const ImageMatrix& image = samples ? *samples : rows;
+		vector<uint8_t> line;
+		for (int i = first; i < first + count; i++, next++) {
+			line.clear();
+			for (int j = 0; j < image.getWidth(); j++) {
+				for (int c = 0; c < channels; c++) {
+					if (wide) {
+						const uint16_t value = image.getSamples<uint16_t>(i)[j * bpp + c];
+						line.push_back(static_cast<uint8_t>(value >> 8));
+						line.push_back(static_cast<uint8_t>(value));
+					}
+					else {
+						line.push_back(image.getRow(i)[j * bpp + c]);
+					}
+				}
+			}
+			if (fwrite(&line[0], 1, line.size(), file) != line.size()) {
+				write_failed(path);
+			}
+		}
+	}
+
+	void finish() override {
+		if (file != nullptr && fclose(file) != 0) {
+			file = nullptr;
+			write_failed(path);
+		}
+		file = nullptr;
+	}
+};
+
+
+/**
+ * Encodes rows into a BMP file as they are written, with the same bytes as write_image.
+ * Rows are stored bottom-up, so each one is written at its place from the end of the file.
+ */
+class BmpWriter : public RowWriter {
+	string path;	// The path of the image
+	int height;	// The height of the image
+	bool dithered;	// Whether wider samples are dithered instead of rounded
+	FILE* file;	// The file, or null before the first write
+	uint64_t pixel_offset;	// Position of the pixels in the file
+	size_t line_size;	// Bytes of one row in the file, padded to 4 bytes
+	int next;	// The next row to write
+
+	/**
+	 * Creates the file and writes its headers: a 24-bit bitmap header, or a V4 header with
+	 * an alpha mask for images with alpha and color
+	 */
+	void open(const int& width, const int& bpp) {
+		file = fopen(path.c_str(), "wb");
+		if (file == nullptr) {
+			write_failed(path);
+		}
+		const bool alpha = bpp == 4;
+		line_size = (static_cast<size_t>(width) * (alpha ? 4 : 3) + 3) / 4 * 4;
+		pixel_offset = BMP_FILE_HEADER_SIZE + (alpha ? BMP_V4_HEADER_SIZE : BMP_INFO_HEADER_SIZE);
+		vector<uint8_t> header = { 'B', 'M' };
+		put_little_endian(header, static_cast<uint32_t>(pixel_offset + line_size * height), 4);
+		put_little_endian(header, 0, 4);
+		put_little_endian(header, static_cast<uint32_t>(pixel_offset), 4);
+		put_little_endian(header, alpha ? BMP_V4_HEADER_SIZE : BMP_INFO_HEADER_SIZE, 4);
+		put_little_endian(header, width, 4);
+		put_little_endian(header, height, 4);
+		put_little_endian(header, 1, 2);
+		put_little_endian(header, alpha ? 32 : 24, 2);
+		put_little_endian(header, alpha ? BMP_BITFIELDS : 0, 4);
+		header.resize(BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE);
+		if (alpha) {
+			for (const uint32_t mask : BMP_MASKS) {
+				put_little_endian(header, mask, 4);
+			}
+			header.resize(BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE);
+		}
+		if (fwrite(&header[0], 1, header.size(), file) != header.size()) {
+			write_failed(path);
+		}
+	}
+
+public:
+	BmpWriter(const string& path, const int& height, const bool& dithered) :
+		path(path), height(height), dithered(dithered), file(nullptr), next(0) {}
+	BmpWriter(const BmpWriter& writer) = delete;
+	BmpWriter& operator=(const BmpWriter& writer) = delete;
+	~BmpWriter() override {
+		if (file != nullptr) {
+			fclose(file);
+		}
+	}
+
+	void write(const ImageMatrix& rows, const int& first, const int& count) override {
+		const int bpp = rows.getBpp();
+		if (file == nullptr) {
+			open(rows.getWidth(), bpp);
+		}
+		unique_ptr<ImageMatrix> samples(quantized(rows, next - first, dithered));
+		const ImageMatrix& image = samples ? *samples : rows;
+		// Gray is written as equal BGR components; alpha is kept only with color
+		vector<uint8_t> line(line_size, 0);
+		for (int i = first; i < first + count; i++, next++) {
+			const uint8_t* row = image.getRow(i);
+			for (int j = 0; j < image.getWidth(); j++) {
+				const uint8_t* pixel = row + j * bpp;
+				uint8_t* bytes = &line[static_cast<size_t>(j) * (bpp == 4 ? 4 : 3)];
+				bytes[0] = pixel[bpp < 3 ? 0 : 2];
+				bytes[1] = pixel[bpp < 3 ? 0 : 1];
+				bytes[2] = pixel[0];
+				if (bpp == 4) {
+					bytes[3] = pixel[3];
+				}
+			}
+			const uint64_t position = pixel_offset + line_size * static_cast<uint64_t>(height - 1 - next);
+			if (!seek_file(file, position) || fwrite(&line[0], 1, line_size, file) != line_size) {
+				write_failed(path);
+			}
+		}
+	}
+
+	void finish() override {
+		if (file != nullptr && fclose(file) != 0) {
+			file = nullptr;
+			write_failed(path);
+		}
+		file = nullptr;
+	}
+};
+
+
+/**
+ * Reads the rows of a tiled image, paging its tiles in as the rows are read
+ */
+class TiledReader : public RowReader {
+	unique_ptr<TiledImage> image;	// The image
+	int next;	// The next row to read
+
+public:
+	explicit TiledReader(TiledImage* image) : image(image), next(0) {}
+
+	int getWidth() const override { return image->getWidth(); }
+	int getHeight() const override { return image->getHeight(); }
+	int getBpp() const override { return image->getBpp(); }
+	SampleType getSampleType() const override { return image->getSampleType(); }
+
+	void read(ImageMatrix& rows, const int& first, const int& count) override {
+		// The rows may be part of a taller band, so they are read into an image of their own
+		ImageMatrix band(getWidth(), count, getBpp(), 0, getSampleType());
+		image->read(band, 0, next);
+		const size_t row_bytes = static_cast<size_t>(getWidth()) * band.getPixelBytes();
+		for (int i = 0; i < count; i++) {
+			memcpy(rows.getRow(first + i), band.getRow(i), row_bytes);
+		}
+		next += count;
+	}
+};
+
+
+/**
+ * Writes rows into a new tiled image, which is created by the first write. Tiles that
+ * leave the cache are stored in the file, so the image never has to be in memory.
+ */
+class TiledWriter : public RowWriter {
+	string path;	// The path of the image
+	int height;	// The height of the image
+	unique_ptr<TiledImage> image;	// The image, or null before the first write
+	int next;	// The next row to write
+
+public:
+	TiledWriter(const string& path, const int& height) : path(path), height(height), next(0) {}
+
+	void write(const ImageMatrix& rows, const int& first, const int& count) override {
+		if (!image) {
+			image.reset(TiledImage::create(path, rows.getWidth(), height, rows.getBpp(), rows.getSampleType()));
+		}
+		ImageMatrix band(rows.getWidth(), count, rows.getBpp(), 0, rows.getSampleType());
+		const size_t row_bytes = static_cast<size_t>(rows.getWidth()) * band.getPixelBytes();
+		for (int i = 0; i < count; i++) {
+			memcpy(band.getRow(i), rows.getRow(first + i), row_bytes);
+		}
+		image->write(band, 0, next);
+		next += count;
+	}
+
+	void finish() override {
+		image.reset();
+	}
+};
+
+
+/**
+ * Collects rows and encodes them with write_image once the image is complete, for the
+ * formats whose encoders take the whole image
+ */
+class BufferedWriter : public RowWriter {
+	string path;	// The path of the image
+	bool dithered;	// Whether wider samples are dithered instead of rounded
+	MatrixWriter rows;	// Collects the rows
+
+public:
+	BufferedWriter(const string& path, const int& height, const bool& dithered) :
+		path(path), dithered(dithered), rows(height) {}
+
+	void write(const ImageMatrix& band, const int& first, const int& count) override {
+		rows.write(band, first, count);
+	}
+
+	void finish() override {
+		const ImageMatrix* image = rows.release();
+		if (image != nullptr) {
+			write_image(path, *image, dithered);
+			delete image;
+		}
+	}
+};
+
+}
+
+
+RowReader* open_image_reader(const string& ref_path) {
+	const string ext = extension(ref_path);
+	if (is_pnm(ext)) {
+		return new PnmReader(ref_path);
+	}
+	if (ext == "tiles") {
+		return new TiledReader(TiledImage::open(ref_path));
+	}
+	if (ext == "bmp") {
+		FILE* file = fopen(ref_path.c_str(), "rb");
+		if (file == nullptr) {
+			read_failed(ref_path);
+		}
+		auto* reader = new BmpReader(ref_path, file);
+		if (reader->supported()) {
+			return reader;
+		}
+		// Palettes, bit masks and RLE are left to the whole-image decoder
+		delete reader;
+	}
+	int width, height, bpp;
+	return new DecodedReader(read_image(ref_path, width, height, bpp));
+}
+
+
+void read_image_format(const string& ref_path, int& bpp, SampleType& sample_type) {
+	const string ext = extension(ref_path);
+	if (is_pnm(ext) || ext == "tiles") {
+		// Only the header is read before the first band
+		unique_ptr<RowReader> reader(open_image_reader(ref_path));
+		bpp = reader->getBpp();
+		sample_type = reader->getSampleType();
+		return;
+	}
+	read_image_info(ref_path, bpp, sample_type);
+}
+
+
+RowWriter* open_image_writer(const string& out_path, const int& height, const bool& dithered) {
+	const string ext = extension(out_path);
+	if (is_pnm(ext)) {
+		return new PnmWriter(out_path, height, dithered);
+	}
+	if (ext == "bmp") {
+		return new BmpWriter(out_path, height, dithered);
+	}
+	if (ext == "tiles") {
+		return new TiledWriter(out_path, height);
+	}
+	return new BufferedWriter(out_path, height, dithered);
+}
+
+
+ImageMatrix* read_rows(RowReader& reader) {
+	auto* image = new ImageMatrix(reader.getWidth(), reader.getHeight(), reader.getBpp(), 0, reader.getSampleType());
+	reader.read(*image, 0, reader.getHeight());
+	return image;
+}
+
+
+void ConvertingReader::read(ImageMatrix& rows, const int& first, const int& count) {
+	ImageMatrix source_rows(getWidth(), count, getBpp(), 0, source.getSampleType());
+	source.read(source_rows, 0, count);
+	const ImageMatrix* samples = source_rows.converted(sample_type);
+	const size_t row_bytes = static_cast<size_t>(getWidth()) * rows.getPixelBytes();
+	for (int i = 0; i < count; i++) {
+		memcpy(rows.getRow(first + i), samples->getRow(i), row_bytes);
+	}
+	delete samples;
+}
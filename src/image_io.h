@@ -0,0 +1,72 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <string>
+#include "pipeline.h"
+
+/**
+ * Opens an image file to be read one band of rows at a time. Binary PGM and PPM files
+ * and uncompressed 24-bit and 32-bit BMP files are decoded as their rows are read, and
+ * tiled images (.tiles) page in their tiles, so only the rows a band needs are ever in
+ * memory. Any other file is decoded whole here.
+ * @param ref_path The path of the image
+ * @return The reader, which the caller deletes
+*/
+RowReader* open_image_reader(const std::string& ref_path);
+
+
+/**
+ * Reads the format an image file is read with from its header
+ * @param ref_path The path of the image
+ * @param bpp A reference to be overridden with the number of channels per pixel
+ * @param sample_type A reference to be overridden with the sample type
+*/
+void read_image_format(const std::string& ref_path, int& bpp, SampleType& sample_type);
+
+
+/**
+ * Opens an image file to be written one band of rows at a time. PGM, PPM and BMP files
+ * are encoded and tiled images are stored as their rows arrive; any other format is
+ * collected and encoded by finish. 16-bit images keep their samples in PGM and PPM files,
+ * and tiled images keep any sample type.
+ * @param out_path The destination path for the new image
+ * @param height The height of the image
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+ * @return The writer, which the caller deletes after calling finish
+*/
+RowWriter* open_image_writer(const std::string& out_path, const int& height, const bool& dithered);
+
+
+/**
+ * Reads every remaining row of an image
+ * @param reader Supplies the rows
+ * @return The image
+*/
+ImageMatrix* read_rows(RowReader& reader);
+
+
+/**
+ * Converts the rows of another reader to a different sample type as they are read
+*/
+class ConvertingReader : public RowReader {
+	RowReader& source;	// Supplies the rows in their original sample type
+	SampleType sample_type;	// The sample type to convert to
+
+public:
+	/**
+	 * Creates a reader that converts the rows of another one
+	 * @param source Supplies the rows, and must outlive this reader
+	 * @param sample_type The sample type to convert to
+	 */
+	ConvertingReader(RowReader& source, const SampleType& sample_type) : source(source), sample_type(sample_type) {}
+
+	int getWidth() const override { return source.getWidth(); }
+	int getHeight() const override { return source.getHeight(); }
+	int getBpp() const override { return source.getBpp(); }
+	SampleType getSampleType() const override { return sample_type; }
+
+	void read(ImageMatrix& rows, const int& first, const int& count) override;
+};
+
+
+#endif
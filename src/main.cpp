@@ -1,12 +1,110 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <memory>
+#include <vector>
 #include "image_functions.h"
+#include "ascii_stream.h"
+#include "buffer_pool.h"
+#include "color_lut.h"
+#include "convolution.h"
+#include "parallel.h"
+#include "image_io.h"
+#include "pipeline.h"
+#include "result_cache.h"
+#include "tiled_image.h"
 #include "util.h"
 #include "CLI11.hpp"
 using namespace std;
 
 
 
+/**
+ * An output image and the functions that make it
+ */
+struct Rendition {
+	string path;	// The path of the output image
+	vector<string> keys;	// The subcommands to run, in order
+};
+
+
+
+/**
+ * Splits an --out value of the form path:function,function into the path and the names of
+ * the functions. The part after the last colon is only taken for functions if it consists
+ * of letters, dashes and commas, so other paths with colons stay as they are.
+ * @param spec The value of --out
+ * @return The rendition, without keys if the value is only a path
+ */
+Rendition parse_rendition(const string& spec);
+
+
+
+/**
+ * Writes an image with the writer for its file format
+ * @param image The image
+ * @param out_path The destination path for the new image
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+ */
+void write_output(const ImageMatrix& image, const string& out_path, const bool& dithered);
+
+
+
+/**
+ * Makes and writes renditions whose keys are the same up to a depth. Renditions that
+ * continue with the same keys share them: each run of keys they have in common runs once,
+ * on a copy of the image that shares its samples until a function writes, and the last
+ * group of renditions takes the image itself.
+ * @param image The output of the keys before depth, which is deleted
+ * @param renditions The renditions
+ * @param depth The number of keys that made the image
+ * @param add_operation Appends the function of a key to a pipeline, or returns false
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+ */
+void run_renditions(ImageMatrix* image, const vector<const Rendition*>& renditions, const size_t& depth,
+	const function<bool(Pipeline&, const string&)>& add_operation, const bool& dithered);
+
+
+
+/**
+ * Runs a pipeline from a reader into an image file, one band at a time if it can
+ * @param pipeline The pipeline
+ * @param reader Supplies the input rows
+ * @param out_path The destination path for the new image
+ * @param border The border mode of the stencils
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+ */
+void run_to_file(const Pipeline& pipeline, RowReader& reader, const string& out_path, const BorderMode& border,
+	const bool& dithered);
+
+
+
+/**
+ * Runs the functions one stage at a time through a result cache. The output image is
+ * copied from the cache if it is there. Otherwise the run starts from the result of the
+ * last stage in the cache, and the result of every stage after it is stored as a tiled
+ * image, which keeps every sample exactly, along with the output image.
+ * @param cache The cache
+ * @param ref_path The path of the input image, whose contents are hashed
+ * @param keys The subcommands to run, in order
+ * @param descriptions Describes each subcommand with its options
+ * @param settings Describes the options that apply to every function
+ * @param add_operation Appends the function of a key to a pipeline
+ * @param float_pipeline Whether the functions run on float samples
+ * @param border The border mode of the stencils
+ * @param out_path The destination path for the new image
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+ */
+void run_cached(const ResultCache& cache, const string& ref_path, const vector<string>& keys,
+	const vector<string>& descriptions, const string& settings,
+	const function<bool(Pipeline&, const string&)>& add_operation, const bool& float_pipeline,
+	const BorderMode& border, const string& out_path, const bool& dithered);
+
+
+
 /**
  * Adds commands and their respective options to the command line application Then,
  * parses commands given by the user, reads the reference image, executes the
@@ -26,21 +124,64 @@ int main(int argc, char** argv) {
 
 
 int process_commands(int argc, char** argv) {
-	int width, height, bpp;
 	string ref_path, out_path;
+	vector<string> out_specs;
 
 
 	// Initialize CLI App
 	CLI::App app{"App description"};
 	argv = app.ensure_utf8(argv);
-	app.require_subcommand();
 
 
 	// Add app options that are applicable to all functions
 	app.add_option("--ref", ref_path,
-		"Reference image path")->required();
-	app.add_option("--out", out_path,
-	"Output image path")->required();
+		"Reference image path");
+	app.add_option("--out", out_specs,
+	"Output image path; repeat it as path:function,function to write several images from one decoded image. "
+	"Subcommands named after a colon only give their options, and the other subcommands run for every image first")
+	->expected(1)
+	->multi_option_policy(CLI::MultiOptionPolicy::TakeAll);
+	BorderMode border{BorderMode::ZERO};
+	const map<string, BorderMode> border_modes{
+		{"zero", BorderMode::ZERO},
+		{"clamp", BorderMode::CLAMP},
+		{"reflect", BorderMode::REFLECT},
+		{"wrap", BorderMode::WRAP}
+	};
+	int threads{0};
+	app.add_option("--threads", threads,
+		"Number of threads to use (0 for one per hardware thread)")
+	->check(CLI::NonNegativeNumber);
+	int tile_cache_mb{256};
+	app.add_option("--tile-cache", tile_cache_mb,
+		"Megabytes of tiles of .tiles images to keep in memory")
+	->check(CLI::PositiveNumber);
+	int buffer_pool_mb{1024};
+	app.add_option("--buffer-pool", buffer_pool_mb,
+		"Megabytes of released image buffers to keep for reuse (0 to free them at once)")
+	->check(CLI::NonNegativeNumber);
+	bool huge_pages{false};
+	app.add_flag("--huge-pages", huge_pages,
+		"Back large image buffers with transparent huge pages where the system supports them");
+	app.add_option("--border", border,
+		"Values of pixels outside the image for kernel operations (zero, clamp, reflect, wrap)")
+	->transform(CLI::CheckedTransformer(border_modes, CLI::ignore_case));
+	vector<int> roi;
+	app.add_option("--roi", roi,
+		"Region to apply the functions to, as x,y,width,height; the rest of the image is kept as it is")
+	->delimiter(',')
+	->expected(4);
+	bool float_pipeline{false};
+	app.add_flag("--float", float_pipeline,
+		"Run every function on float samples, which are only rounded when the output image is written");
+	string cache_dir;
+	app.add_option("--cache", cache_dir,
+		"Directory of cached results: a run repeated on the same image copies its output from there, and a run "
+		"whose last functions changed starts from the cached result of the functions before them")
+	->check(CLI::ExistingDirectory);
+	bool dither_output{false};
+	app.add_flag("--dither", dither_output,
+		"Dither the output image instead of rounding it when it has more than 8 bits per sample");
 
 
 	// --- Commands and their respective options ---
@@ -59,6 +200,24 @@ int process_commands(int argc, char** argv) {
 	app.get_subcommand("ascii")->add_option("--ratio", ascii_ratio,
 		"The width/height ratio to stretch the image by");
 
+	app.add_subcommand("ascii-stream",
+		"Renders a stream of raw frames (Y4M or rgb24) as ASCII art on the terminal");
+	AsciiStreamOptions ascii_stream_options;
+	app.get_subcommand("ascii-stream")->add_option("--cols", ascii_stream_options.cols,
+	"The number of characters along the width");
+	app.get_subcommand("ascii-stream")->add_option("--ratio", ascii_stream_options.ratio,
+		"The width/height ratio to stretch the frames by");
+	app.get_subcommand("ascii-stream")->add_option("--width", ascii_stream_options.width,
+		"The width of raw rgb24 frames");
+	app.get_subcommand("ascii-stream")->add_option("--height", ascii_stream_options.height,
+		"The height of raw rgb24 frames");
+	app.get_subcommand("ascii-stream")->add_option("--fps", ascii_stream_options.fps,
+		"Playback rate (defaults to the rate of the stream, or 30)")
+	->check(CLI::NonNegativeNumber);
+	bool ascii_stream_unpaced{false};
+	app.get_subcommand("ascii-stream")->add_flag("--unpaced", ascii_stream_unpaced,
+		"Render every frame as fast as possible instead of in real time");
+
     app.add_subcommand("outline",
     	"Highlights large differences in pixel values");
 
@@ -90,8 +249,44 @@ int process_commands(int argc, char** argv) {
 		"Standard deviation of the Gaussian distribution")
 	->check(CLI::Range(0.0, 25.0));
 
+	app.add_subcommand("convolve",
+		"Convolves the image with a user-defined kernel");
+	string convolve_kernel_text;
+	string convolve_kernel_path;
+	CLI::Option* convolve_kernel_option = app.get_subcommand("convolve")->add_option("--kernel", convolve_kernel_text,
+		"The kernel, with rows separated by ';' and entries by ',' (e.g. \"1,2,1;2,4,2;1,2,1\")");
+	app.get_subcommand("convolve")->add_option("--kernel-file", convolve_kernel_path,
+		"A text file holding the kernel, one row per line")
+	->check(CLI::ExistingFile)
+	->excludes(convolve_kernel_option);
+	double convolve_scale{1.0};
+	app.get_subcommand("convolve")->add_option("--scale", convolve_scale,
+		"A scalar by which to multiply the kernel");
+	bool convolve_normalize{false};
+	app.get_subcommand("convolve")->add_flag("--normalize", convolve_normalize,
+		"Divide the kernel by the sum of its entries");
+
+	app.add_subcommand("lut",
+		"Maps the colors through a 1D or 3D lookup table in the .cube format");
+	string lut_path;
+	app.get_subcommand("lut")->add_option("--file", lut_path,
+		"Path of the .cube file")
+	->required()
+	->check(CLI::ExistingFile);
+	LutInterpolation lut_interpolation{LutInterpolation::TRILINEAR};
+	const map<string, LutInterpolation> lut_interpolations{
+		{"trilinear", LutInterpolation::TRILINEAR},
+		{"tetrahedral", LutInterpolation::TETRAHEDRAL}
+	};
+	app.get_subcommand("lut")->add_option("--interpolation", lut_interpolation,
+		"Sampling between the points of a 3D table (trilinear, tetrahedral)")
+	->transform(CLI::CheckedTransformer(lut_interpolations, CLI::ignore_case));
+
     app.add_subcommand("grayscale",
     	"Averages the colors of an image to make it grayscale");
+	bool grayscale_single_channel{false};
+	app.get_subcommand("grayscale")->add_flag("--single-channel", grayscale_single_channel,
+		"Write one channel weighted by luminance (plus alpha) instead of three averaged channels");
 
     app.add_subcommand("invert",
     	"Inverts the colors of the image");
@@ -123,108 +318,512 @@ int process_commands(int argc, char** argv) {
 
 	// --- Parse commands ---
 	CLI11_PARSE(app, argc, argv);
-
-
-	// Read image
-	const ImageMatrix* image = read_image(ref_path, width, height, bpp);
-	// Print read image confirmation message
-	cout << "Finished reading reference image." << endl;
-
-
-	// --- Perform functions ---
+	set_thread_count(threads);
+	set_tile_cache_budget(static_cast<size_t>(tile_cache_mb) << 20);
+	shared_buffer_pool().setLimit(static_cast<size_t>(buffer_pool_mb) << 20);
+	shared_buffer_pool().setHugePages(huge_pages);
+
+
+	// Streams are read from --ref (or standard input) and drawn on the terminal
+	if (app.got_subcommand("ascii-stream")) {
+		ascii_stream_options.paced = !ascii_stream_unpaced;
+		FILE* in = stdin;
+		if (!ref_path.empty() && ref_path != "-") {
+			in = fopen(ref_path.c_str(), "rb");
+			if (in == nullptr) {
+				cout << "Could not open stream: " << ref_path << endl;
+				return 2;
+			}
+		}
+		const int code = ascii_stream(in, stdout, ascii_stream_options);
+		if (in != stdin) {
+			fclose(in);
+		}
+		return code;
+	}
+	if (ref_path.empty()) {
+		return app.exit(CLI::RequiredError("--ref"));
+	}
+	if (out_specs.empty()) {
+		return app.exit(CLI::RequiredError("--out"));
+	}
+	vector<Rendition> renditions;
+	for (const string& spec : out_specs) {
+		renditions.push_back(parse_rendition(spec));
+	}
+	out_path = renditions[0].path;
+	const bool fan_out = renditions.size() > 1 || !renditions[0].keys.empty();
+	// Subcommands named by an output only lend it their options; the others run for every output
+	vector<string> prefix_keys;
 	for (const auto *subcom : app.get_subcommands()) {
-		ImageMatrix* temp;
-		string key = subcom->get_name();
+		const string key = subcom->get_name();
+		bool branch_key = false;
+		for (const Rendition& rendition : renditions) {
+			branch_key |= find(rendition.keys.begin(), rendition.keys.end(), key) != rendition.keys.end();
+		}
+		if (!branch_key) {
+			prefix_keys.push_back(key);
+		}
+	}
+	if (!fan_out && prefix_keys.empty()) {
+		return app.exit(CLI::RequiredError::Subcommand(1));
+	}
+
 
+	// --- Build the pipeline; nothing runs until the output is requested ---
+	// Outputs and cached stages build the same functions again, but the kernel is described once
+	bool kernel_described = false;
+	// Appends the function of a subcommand, with the options given to it, to a pipeline;
+	// returns false for ascii, which is not an image function
+	auto add_operation = [&](Pipeline& target, const string& key) {
 		if (key == "pixelate") {
-			temp = pixelate(*image,
-				pixelate_divs);
+			target.add_resample(key, [=](const ImageMatrix& image) {
+				return pixelate(image,
+					pixelate_divs);
+			}, [=](const int& width, const int& height) {
+				return new Pixelator(width, height, pixelate_divs);
+			});
 		}
 
 		else if (key == "ascii") {
-			const string ascii_str = ascii(*image, ascii_cols, ascii_ratio);
-			write_textfile(out_path, ascii_str);
-			// Delete image
-			delete image;
-			// Print the ASCII art
-			cout << ascii_str << endl;
-			// Print completion confirmation message
-			cout << "Finished writing output text file. Cannot perform further operations" << endl;
-			// Exit program
-			return 0;
+			// ASCII art is text, so no operation can follow it
+			return false;
 		}
 
 		else if (key == "outline") {
-			temp = outline(*image);
+			target.add_stencil(key, 1, [=](const ImageMatrix& image) {
+				return outline(image, border);
+			});
 		}
 
 		else if (key == "sharpen") {
-			temp = sharpen(*image);
+			target.add_stencil(key, 1, [=](const ImageMatrix& image) {
+				return sharpen(image, border);
+			});
 		}
 
 		else if (key == "contrast") {
-			cout << contrast_value;
-			temp = contrast(*image,
-				contrast_value);
+			target.add_filter(key, contrast_matrix(contrast_value));
 		}
 
 		else if (key == "box-blur") {
-			temp = box_blur(*image,
-			box_blur_radius);
+			target.add_stencil(key, box_blur_radius, [=](const ImageMatrix& image) {
+				return box_blur(image,
+				box_blur_radius,
+				border);
+			});
 		}
 
 		else if (key == "gaussian-blur") {
-			temp = gaussian_blur(*image,
-			gaussian_blur_radius,
-			gaussian_blur_sigma);
+			target.add_stencil(key, gaussian_blur_radius, [=](const ImageMatrix& image) {
+				return gaussian_blur(image,
+				gaussian_blur_radius,
+				gaussian_blur_sigma,
+				border);
+			});
+		}
+
+		else if (key == "convolve") {
+			vector<double> kernel;
+			const string kernel_text = convolve_kernel_path.empty()
+				? convolve_kernel_text : read_textfile(convolve_kernel_path);
+			if (!parse_kernel(kernel_text, kernel)) {
+				cout << "The kernel must be square with an odd number of rows." << endl;
+				exit(1);
+			}
+			if (!kernel_described) {
+				// The backend depends on the samples the kernel runs on, as ImageMatrix::convolve picks it
+				const double scalar = kernel_scalar(kernel, convolve_scale, convolve_normalize);
+				int bpp;
+				SampleType sample_type;
+				read_image_format(ref_path, bpp, sample_type);
+				const bool float_planes = float_pipeline
+					|| convolves_float_planes(bpp, sample_type, &kernel[0], kernel.size(), scalar);
+				cout << "Kernel: " << describe_kernel(analyze_kernel(&kernel[0], kernel.size(), scalar),
+					float_planes) << endl;
+				kernel_described = true;
+			}
+			const int kernel_radius = static_cast<int>(sqrt(kernel.size())) / 2;
+			target.add_stencil(key, kernel_radius, [=](const ImageMatrix& image) {
+				return convolve_kernel(image,
+					kernel,
+					convolve_scale,
+					convolve_normalize,
+					border);
+			});
+		}
+
+		else if (key == "lut") {
+			const shared_ptr<const ColorLut> lut(read_cube(lut_path));
+			target.add(key, OperationKind::POINT, [=](const ImageMatrix& image) {
+				return apply_lut(image,
+					*lut,
+					lut_interpolation);
+			});
 		}
 
 		else if (key == "grayscale") {
-			temp = grayscale(*image);
+			if (grayscale_single_channel) {
+				target.add_gray(key, luminance);
+			}
+			else {
+				target.add_filter(key, grayscale_matrix());
+			}
 		}
 
 		else if (key == "invert") {
-			temp = invert(*image);
+			target.add_filter(key, invert_matrix());
 		}
 
 		else if (key == "sepia") {
-			temp = sepia(*image);
+			target.add_filter(key, sepia_matrix());
 		}
 
 		else if (key == "color") {
-			temp = color(*image,
-				color_hex);
+			target.add_filter(key, color_matrix(color_hex));
 		}
 
 		else if (key == "enable-channels") {
-			temp = enable_channels(*image,
+			target.add_filter(key, enable_channels_matrix(
 				red_channel_enabled > 0,
 				green_channel_enabled > 0,
-				blue_channel_enabled > 0);
+				blue_channel_enabled > 0));
 		}
 
 		else if (key == "octopus-dragon") {
-			temp = octopus_dragon(*image);
+			target.add_filter(key, octopus_dragon_matrix());
 		}
 
 		else {
 			cout << "Could not find valid image processing function command." << endl;
 			exit(1);
 		}
+		return true;
+	};
+
 
+	// A cached run only reads the image if the output is not in the cache, and then only
+	// from the last cached stage
+	const bool cacheable = !fan_out && roi.empty()
+		&& find(prefix_keys.begin(), prefix_keys.end(), "ascii") == prefix_keys.end();
+	if (!cache_dir.empty() && !cacheable) {
+		cout << "The cache is not used for a region, several outputs or ASCII art." << endl;
+	}
+	if (!cache_dir.empty() && cacheable) {
+		vector<string> descriptions;
+		for (const string& key : prefix_keys) {
+			string description = key + "\n" + app.get_subcommand(key)->config_to_str(true, false);
+			// Functions that read a file depend on its contents, not just its path
+			if (key == "lut") {
+				description += cache_key(hash_file(lut_path), "");
+			}
+			else if (key == "convolve" && !convolve_kernel_path.empty()) {
+				description += cache_key(hash_file(convolve_kernel_path), "");
+			}
+			descriptions.push_back(description);
+		}
+		const string settings = string("float ") + (float_pipeline ? "on" : "off")
+			+ " border " + to_string(static_cast<int>(border));
+		run_cached(ResultCache(cache_dir), ref_path, prefix_keys, descriptions, settings, add_operation,
+			float_pipeline, border, out_path, dither_output);
+		return 0;
+	}
+
+
+	// Open the image; formats that decode row by row are only read as the pipeline needs rows
+	unique_ptr<RowReader> file_reader(open_image_reader(ref_path));
+	RowReader* reader = file_reader.get();
+	// Convert to the float working space once, so no function clamps or rounds its output
+	unique_ptr<RowReader> float_reader;
+	if (float_pipeline && reader->getSampleType() != SampleType::F32) {
+		float_reader.reset(new ConvertingReader(*reader, SampleType::F32));
+		reader = float_reader.get();
+	}
+	// Print read image confirmation message
+	cout << "Finished reading reference image." << endl;
+
+
+	Pipeline pipeline;
+	bool ascii_requested = false;
+	for (const string& key : prefix_keys) {
+		if (!add_operation(pipeline, key)) {
+			ascii_requested = true;
+			break;
+		}
+	}
+	if (fan_out) {
+		// Every output comes from the same decoded image, through a tree of pipelines
+		if (ascii_requested) {
+			cout << "ASCII art cannot be written along with other outputs." << endl;
+			exit(1);
+		}
+		if (!roi.empty()) {
+			cout << "A region cannot be combined with several outputs." << endl;
+			exit(1);
+		}
+		vector<const Rendition*> chains;
+		for (Rendition& rendition : renditions) {
+			rendition.keys.insert(rendition.keys.begin(), prefix_keys.begin(), prefix_keys.end());
+			chains.push_back(&rendition);
+		}
+		run_renditions(read_rows(*reader), chains, 0, add_operation, dither_output);
+		return 0;
+	}
+
+
+	// --- Perform functions ---
+	if (pipeline.optimize(reader->getBpp(), reader->getSampleType())) {
+		cout << "Optimized pipeline: " << pipeline.describe() << endl;
+	}
+	if (!ascii_requested && roi.empty() && pipeline.streamable(border)) {
+		// Only a band of rows of every intermediate image exists at a time, from decoding
+		// the input to encoding the output
+		int output_width = reader->getWidth();
+		int output_height = reader->getHeight();
+		pipeline.output_size(output_width, output_height);
+		unique_ptr<RowWriter> writer(open_image_writer(out_path, output_height, dither_output));
+		pipeline.stream(*reader, *writer, 0);
+		writer->finish();
+		cout << "Finished writing output image." << endl;
+		return 0;
+	}
+	const ImageMatrix* image;
+	if (!roi.empty()) {
+		// Only the region runs through the pipeline, together with the neighbors its
+		// stencils read, and the result is copied back over the region
+		const int roi_x = roi[0], roi_y = roi[1], roi_width = roi[2], roi_height = roi[3];
+		if (roi_x < 0 || roi_y < 0 || roi_width <= 0 || roi_height <= 0
+			|| roi_x + roi_width > reader->getWidth() || roi_y + roi_height > reader->getHeight()) {
+			cout << "The region must lie inside the image." << endl;
+			exit(1);
+		}
+		const int halo = pipeline.halo();
+		int context_x = max(0, roi_x - halo);
+		int context_y = max(0, roi_y - halo);
+		ImageMatrix* input = read_rows(*reader);
+		int context_right = min(input->getWidth(), roi_x + roi_width + halo);
+		int context_bottom = min(input->getHeight(), roi_y + roi_height + halo);
+		// Wrapped stencils read the far side of the image, which a clipped context would replace
+		// with its own far side, so a region near an edge runs with the whole image
+		if (border == BorderMode::WRAP && halo > 0 && (context_x == 0 || context_y == 0
+			|| context_right == input->getWidth() || context_bottom == input->getHeight())) {
+			context_x = 0;
+			context_y = 0;
+			context_right = input->getWidth();
+			context_bottom = input->getHeight();
+		}
+		const ImageView context(*input, context_x, context_y,
+			context_right - context_x, context_bottom - context_y);
+		ImageMatrix* output = pipeline.run(context);
+		if (output->getWidth() != context.getWidth() || output->getHeight() != context.getHeight()
+			|| output->getBpp() != input->getBpp() || output->getSampleType() != input->getSampleType()) {
+			cout << "Functions applied to a region must keep its size and channels." << endl;
+			exit(1);
+		}
+		ImageView(*input, roi_x, roi_y, roi_width, roi_height).copy_from(
+			ImageView(*output, roi_x - context_x, roi_y - context_y, roi_width, roi_height));
+		delete output;
+		image = input;
+	}
+	else if (pipeline.streamable(border)) {
+		int output_width = reader->getWidth();
+		int output_height = reader->getHeight();
+		pipeline.output_size(output_width, output_height);
+		MatrixWriter writer(output_height);
+		pipeline.stream(*reader, writer, 0);
+		image = writer.release();
+	}
+	else {
+		image = pipeline.run_in_place(read_rows(*reader));
+	}
+
+	if (ascii_requested) {
+		const string ascii_str = ascii(*image, ascii_cols, ascii_ratio);
+		write_textfile(out_path, ascii_str);
+		// Delete image
 		delete image;
-		image = temp;
+		// Print the ASCII art
+		cout << ascii_str << endl;
+		// Print completion confirmation message
+		cout << "Finished writing output text file. Cannot perform further operations" << endl;
+		// Exit program
+		return 0;
 	}
 
 
 	// Write the output image
-	write_image(out_path, *image);
+	write_output(*image, out_path, dither_output);
 
 	// Delete image
 	delete image;
 
+	return 0;
+}
+
+
+
+Rendition parse_rendition(const string& spec) {
+	const size_t colon = spec.find_last_of(':');
+	if (colon == string::npos || colon + 1 == spec.size()
+		|| spec.find_first_not_of("abcdefghijklmnopqrstuvwxyz-,", colon + 1) != string::npos) {
+		return Rendition{spec, {}};
+	}
+	Rendition rendition{spec.substr(0, colon), {}};
+	stringstream keys(spec.substr(colon + 1));
+	string key;
+	while (getline(keys, key, ',')) {
+		if (!key.empty()) {
+			rendition.keys.push_back(key);
+		}
+	}
+	return rendition;
+}
+
+
+
+void write_output(const ImageMatrix& image, const string& out_path, const bool& dithered) {
+	unique_ptr<RowWriter> writer(open_image_writer(out_path, image.getHeight(), dithered));
+	writer->write(image, 0, image.getHeight());
+	writer->finish();
+
 	// Print completion confirmation message
 	cout << "Finished writing output image." << endl;
+}
 
-	return 0;
-}
\ No newline at end of file
+
+
+void run_renditions(ImageMatrix* image, const vector<const Rendition*>& renditions, const size_t& depth,
+	const function<bool(Pipeline&, const string&)>& add_operation, const bool& dithered) {
+	vector<const Rendition*> rest;
+	for (const Rendition* rendition : renditions) {
+		if (rendition->keys.size() == depth) {
+			write_output(*image, rendition->path, dithered);
+		}
+		else {
+			rest.push_back(rendition);
+		}
+	}
+	if (rest.empty()) {
+		delete image;
+		return;
+	}
+	while (!rest.empty()) {
+		// The renditions that go on with the same key as the first one form a group
+		vector<const Rendition*> group, others;
+		for (const Rendition* rendition : rest) {
+			(rendition->keys[depth] == rest[0]->keys[depth] ? group : others).push_back(rendition);
+		}
+		// The group runs every following key that all of its renditions have in common
+		size_t end = depth + 1;
+		bool common = true;
+		while (common) {
+			for (const Rendition* rendition : group) {
+				common = common && rendition->keys.size() > end && rendition->keys[end] == group[0]->keys[end];
+			}
+			end += common ? 1 : 0;
+		}
+		Pipeline segment;
+		for (size_t i = depth; i < end; i++) {
+			if (!add_operation(segment, group[0]->keys[i])) {
+				cout << "ASCII art cannot be written along with other outputs." << endl;
+				exit(1);
+			}
+		}
+		segment.optimize(image->getBpp(), image->getSampleType());
+		// Only the last group may overwrite the image; the others filter a copy that shares it
+		ImageMatrix* input = others.empty() ? image : new ImageMatrix(*image);
+		run_renditions(segment.run_in_place(input), group, end, add_operation, dithered);
+		rest = others;
+	}
+}
+
+
+
+void run_to_file(const Pipeline& pipeline, RowReader& reader, const string& out_path, const BorderMode& border,
+	const bool& dithered) {
+	if (pipeline.streamable(border)) {
+		int output_width = reader.getWidth();
+		int output_height = reader.getHeight();
+		pipeline.output_size(output_width, output_height);
+		unique_ptr<RowWriter> writer(open_image_writer(out_path, output_height, dithered));
+		pipeline.stream(reader, *writer, 0);
+		writer->finish();
+		return;
+	}
+	const ImageMatrix* image = pipeline.run_in_place(read_rows(reader));
+	unique_ptr<RowWriter> writer(open_image_writer(out_path, image->getHeight(), dithered));
+	writer->write(*image, 0, image->getHeight());
+	writer->finish();
+	delete image;
+}
+
+
+
+void run_cached(const ResultCache& cache, const string& ref_path, const vector<string>& keys,
+	const vector<string>& descriptions, const string& settings,
+	const function<bool(Pipeline&, const string&)>& add_operation, const bool& float_pipeline,
+	const BorderMode& border, const string& out_path, const bool& dithered) {
+	// Neighboring filters form one stage, so the optimizer can combine them as it does
+	// without the cache; every other function is a stage of its own
+	Pipeline functions;
+	for (const string& key : keys) {
+		add_operation(functions, key);
+	}
+	const vector<Operation>& operations = functions.getOperations();
+	vector<size_t> stage_ends;
+	for (size_t i = 0; i < operations.size(); i++) {
+		if (i + 1 == operations.size() || operations[i].matrix.empty() || operations[i + 1].matrix.empty()) {
+			stage_ends.push_back(i + 1);
+		}
+	}
+	// Each stage is keyed by the input and every function up to its end
+	const uint64_t input_hash = hash_file(ref_path);
+	string description = settings;
+	vector<string> stage_keys;
+	for (size_t i = 0, stage = 0; i < descriptions.size(); i++) {
+		description += "\n" + descriptions[i];
+		if (i + 1 == stage_ends[stage]) {
+			stage_keys.push_back(cache_key(input_hash, description));
+			stage++;
+		}
+	}
+	const string extension = out_path.substr(out_path.find_last_of('.') + 1);
+	const string output_key = cache_key(input_hash, description + (dithered ? "\ndithered" : "\nrounded"));
+	if (cache.contains(output_key, extension)) {
+		cache.fetch(output_key, extension, out_path);
+		cout << "Found the output image in the cache." << endl;
+		cout << "Finished writing output image." << endl;
+		return;
+	}
+
+	size_t cached_stages = stage_keys.size();
+	while (cached_stages > 0 && !cache.contains(stage_keys[cached_stages - 1], "tiles")) {
+		cached_stages--;
+	}
+	unique_ptr<RowReader> file_reader(open_image_reader(
+		cached_stages > 0 ? cache.path(stage_keys[cached_stages - 1], "tiles") : ref_path));
+	RowReader* reader = file_reader.get();
+	// Cached stages are float already
+	unique_ptr<RowReader> float_reader;
+	if (float_pipeline && reader->getSampleType() != SampleType::F32) {
+		float_reader.reset(new ConvertingReader(*reader, SampleType::F32));
+		reader = float_reader.get();
+	}
+	cout << "Finished reading reference image." << endl;
+	for (size_t stage = cached_stages; stage < stage_keys.size(); stage++) {
+		Pipeline stage_pipeline;
+		for (size_t i = stage > 0 ? stage_ends[stage - 1] : 0; i < stage_ends[stage]; i++) {
+			stage_pipeline.add(operations[i]);
+		}
+		stage_pipeline.optimize(reader->getBpp(), reader->getSampleType());
+		const string temporary = cache.temporary_path(stage_keys[stage], "tiles");
+		run_to_file(stage_pipeline, *reader, temporary, border, false);
+		cache.commit(temporary, stage_keys[stage], "tiles");
+		float_reader.reset();
+		file_reader.reset(open_image_reader(cache.path(stage_keys[stage], "tiles")));
+		reader = file_reader.get();
+	}
+	run_to_file(Pipeline(), *reader, out_path, border, dithered);
+	cache.store(out_path, output_key, extension);
+	cout << "Finished writing output image." << endl;
+}
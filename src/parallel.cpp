@@ -0,0 +1,128 @@
+#include "parallel.h"
+#include <algorithm>
+#include <memory>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+using namespace std;
+
+
+constexpr size_t DEFAULT_L1_CACHE_SIZE = 32 * 1024;	// Assumed L1 data cache size if detection fails
+constexpr size_t DEFAULT_L2_CACHE_SIZE = 256 * 1024;	// Assumed L2 cache size if detection fails
+
+
+namespace {
+
+int requested_threads = 0;	// Threads requested through set_thread_count, 0 for all
+unique_ptr<ThreadPool> shared_pool;	// Created on first use
+thread_local bool inside_task = false;	// Whether the current thread is running a pool task
+
+}
+
+
+ThreadPool::ThreadPool(const int& threads)
+	: task(nullptr), count(0), next(0), active(0), generation(0), stopping(false) {
+	for (int i = 1; i < threads; i++) {
+		workers.emplace_back(&ThreadPool::work, this);
+	}
+}
+
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (thread& worker : workers) {
+		worker.join();
+	}
+}
+
+
+void ThreadPool::drain() {
+	inside_task = true;
+	for (int i = next++; i < count; i = next++) {
+		(*task)(i);
+	}
+	inside_task = false;
+}
+
+
+void ThreadPool::work() {
+	long seen = 0;
+	while (true) {
+		{
+			unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) {
+				return;
+			}
+			seen = generation;
+		}
+		drain();
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if (--active == 0) {
+				done.notify_one();
+			}
+		}
+	}
+}
+
+
+void ThreadPool::run(const int& count, const function<void(int)>& task) {
+	if (workers.empty() || count <= 1) {
+		for (int i = 0; i < count; i++) {
+			task(i);
+		}
+		return;
+	}
+	{
+		lock_guard<std::mutex> lock(mutex);
+		this->task = &task;
+		this->count = count;
+		next = 0;
+		active = static_cast<int>(workers.size());
+		generation++;
+	}
+	wake.notify_all();
+	drain();
+	unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return active == 0; });
+	this->task = nullptr;
+}
+
+
+void set_thread_count(const int& threads) {
+	requested_threads = threads;
+	shared_pool.reset();
+}
+
+
+void parallel_for(const int& count, const function<void(int)>& task) {
+	if (inside_task) {
+		for (int i = 0; i < count; i++) {
+			task(i);
+		}
+		return;
+	}
+	if (!shared_pool) {
+		const int threads = requested_threads > 0 ? requested_threads
+			: max(1, static_cast<int>(thread::hardware_concurrency()));
+		shared_pool.reset(new ThreadPool(threads));
+	}
+	shared_pool->run(count, task);
+}
+
+
+size_t cache_size(const int& level) {
+	const size_t fallback = level <= 1 ? DEFAULT_L1_CACHE_SIZE : DEFAULT_L2_CACHE_SIZE;
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_SIZE)
+	const long size = sysconf(level <= 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+	if (size > 0) {
+		return static_cast<size_t>(size);
+	}
+#endif
+	return fallback;
+}
@@ -0,0 +1,88 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that run numbered tasks. The calling thread takes
+ * part in the work, so a pool of n threads starts n - 1 workers.
+*/
+class ThreadPool {
+	std::vector<std::thread> workers;	// The worker threads
+	std::mutex mutex;	// Guards the job state below
+	std::condition_variable wake;	// Signals the workers that a job was posted
+	std::condition_variable done;	// Signals the caller that every worker finished
+	const std::function<void(int)>* task;	// The current job
+	int count;	// The number of tasks in the current job
+	std::atomic<int> next;	// The next task to hand out
+	int active;	// Workers that have not finished the current job yet
+	long generation;	// Incremented for every job
+	bool stopping;	// Whether the workers should exit
+
+	/**
+	 * Runs tasks of the current job until none are left
+	 */
+	void drain();
+
+	/**
+	 * The loop executed by each worker thread
+	 */
+	void work();
+
+public:
+	/**
+	 * Starts the worker threads
+	 * @param threads The total number of threads, including the caller
+	 */
+	explicit ThreadPool(const int& threads);
+
+	ThreadPool(const ThreadPool& pool) = delete;
+	ThreadPool& operator=(const ThreadPool& pool) = delete;
+
+	/**
+	 * Stops and joins the worker threads
+	 */
+	~ThreadPool();
+
+	int getThreads() const { return static_cast<int>(workers.size()) + 1; }
+
+	/**
+	 * Runs task(0) ... task(count - 1) across the pool and waits for all of them
+	 * @param count The number of tasks
+	 * @param task The task, called with the task number
+	 */
+	void run(const int& count, const std::function<void(int)>& task);
+};
+
+
+/**
+ * Sets the number of threads used by parallel_for. Takes effect on the next call.
+ * @param threads The number of threads, or 0 for one per hardware thread
+*/
+void set_thread_count(const int& threads);
+
+
+/**
+ * Runs task(0) ... task(count - 1) on the shared thread pool and waits for all of them.
+ * Calls made from inside a task run serially on the calling thread.
+ * @param count The number of tasks
+ * @param task The task, called with the task number
+*/
+void parallel_for(const int& count, const std::function<void(int)>& task);
+
+
+/**
+ * Returns the size of a data cache of the processor
+ * @param level The cache level (1 or 2)
+ * @return The size in bytes, or a typical size if it cannot be detected
+*/
+size_t cache_size(const int& level);
+
+
+#endif
@@ -0,0 +1,358 @@
+#include "pipeline.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+using namespace std;
+
+
+constexpr size_t STREAM_BAND_BYTES = 4 << 20;	// Size of a band of input rows to aim for
+constexpr int STREAM_HALO_FACTOR = 4;	// Smallest band height relative to the halo
+
+
+namespace {
+
+/**
+ * Checks whether a filter matrix leaves every channel as it is
+ */
+bool identity_filter(const vector<double>& matrix) {
+	for (int c = 0; c < 3; c++) {
+		for (int k = 0; k < 4; k++) {
+			if (matrix[c * 4 + k] != (k == c ? 1.0 : 0.0)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Checks whether every weight and offset of a filter matrix is an integer
+ */
+bool integer_filter(const vector<double>& matrix) {
+	for (const double entry : matrix) {
+		if (entry != floor(entry)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Checks whether a filter matrix maps integer samples to integers in range, so its
+ * output is never clamped or rounded
+ */
+bool exact_filter(const vector<double>& matrix) {
+	if (!integer_filter(matrix)) {
+		return false;
+	}
+	// The smallest and largest outputs are reached at corners of the color cube
+	for (int c = 0; c < 3; c++) {
+		double low = matrix[c * 4 + 3];
+		double high = matrix[c * 4 + 3];
+		for (int k = 0; k < 3; k++) {
+			low += min(0.0, matrix[c * 4 + k]) * 255;
+			high += max(0.0, matrix[c * 4 + k]) * 255;
+		}
+		if (low < 0 || high > 255) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Checks whether every row of a filter matrix copies one input channel or is zero
+ */
+bool selects_channels(const vector<double>& matrix) {
+	for (int c = 0; c < 3; c++) {
+		int ones = 0;
+		for (int k = 0; k < 3; k++) {
+			const double weight = matrix[c * 4 + k];
+			if (weight != 0.0 && weight != 1.0) {
+				return false;
+			}
+			ones += weight == 1.0;
+		}
+		if (ones > 1 || matrix[c * 4 + 3] != 0.0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Multiplies two filter matrices
+ * @param first The filter that runs first
+ * @param second The filter that runs second
+ * @return The filter that does both at once
+ */
+vector<double> compose_filters(const vector<double>& first, const vector<double>& second) {
+	vector<double> matrix(12, 0.0);
+	for (int c = 0; c < 3; c++) {
+		for (int k = 0; k < 4; k++) {
+			for (int j = 0; j < 3; j++) {
+				matrix[c * 4 + k] += second[c * 4 + j] * first[j * 4 + k];
+			}
+		}
+		matrix[c * 4 + 3] += second[c * 4 + 3];
+	}
+	return matrix;
+}
+
+
+/**
+ * Checks whether two neighboring filters can be replaced by their product
+ * @param first The filter that runs first
+ * @param second The filter that runs second
+ * @param gray Whether the input of the first filter may be gray
+ * @param sample_type The sample type of the image
+ * @return Whether the product gives the same samples
+ */
+bool fusible(const vector<double>& first, const vector<double>& second, const bool& gray,
+	const SampleType& sample_type) {
+	// A gray image that the first filter turned RGB could stay gray under the product,
+	// or the other way around
+	if (gray && (!filter_keeps_gray(first.data(), sample_type)
+		|| filter_keeps_gray(compose_filters(first, second).data(), sample_type)
+			!= filter_keeps_gray(second.data(), sample_type))) {
+		return false;
+	}
+	if (sample_type == SampleType::F32) {
+		return true;
+	}
+	// Integer samples are rounded and clamped after every filter. That is exact if the
+	// first filter's output is already in range and the product is still computed on
+	// integers, or if the second filter only copies rows of the first one.
+	return selects_channels(second) || (exact_filter(first) && integer_filter(second));
+}
+
+}
+
+
+void Pipeline::add(const string& name, const OperationKind& kind,
+	const function<ImageMatrix*(const ImageMatrix&)>& apply) {
+	operations.push_back(Operation{name, kind, {}, 0, false, apply, nullptr});
+}
+
+
+void Pipeline::add(const Operation& operation) {
+	operations.push_back(operation);
+}
+
+
+void Pipeline::add_stencil(const string& name, const int& radius,
+	const function<ImageMatrix*(const ImageMatrix&)>& apply) {
+	operations.push_back(Operation{name, OperationKind::STENCIL, {}, radius, false, apply, nullptr});
+}
+
+
+void Pipeline::add_resample(const string& name, const function<ImageMatrix*(const ImageMatrix&)>& apply,
+	const function<ResampleStage*(const int&, const int&)>& stage) {
+	operations.push_back(Operation{name, OperationKind::RESAMPLE, {}, 0, false, apply, stage});
+}
+
+
+void Pipeline::add_gray(const string& name, const function<ImageMatrix*(const ImageMatrix&)>& apply) {
+	operations.push_back(Operation{name, OperationKind::POINT, {}, 0, true, apply, nullptr});
+}
+
+
+void Pipeline::add_filter(const string& name, const vector<double>& matrix) {
+	operations.push_back(Operation{name, OperationKind::POINT, matrix, 0, false,
+		[matrix](const ImageMatrix& image) { return image.filter(matrix.data()); }, nullptr});
+}
+
+
+bool Pipeline::optimize(const int& bpp, const SampleType& sample_type) {
+	bool optimized = false;
+	bool changed = true;
+	// Every rewrite may enable another, so passes repeat until one changes nothing
+	while (changed) {
+		changed = false;
+		const size_t count = operations.size();
+		operations.erase(remove_if(operations.begin(), operations.end(), [](const Operation& operation) {
+			return !operation.matrix.empty() && identity_filter(operation.matrix);
+		}), operations.end());
+		changed = operations.size() != count;
+		bool gray = bpp < 3;
+		for (size_t i = 0; i < operations.size(); i++) {
+			const Operation& operation = operations[i];
+			if (i + 1 < operations.size() && !operation.matrix.empty() && !operations[i + 1].matrix.empty()
+				&& fusible(operation.matrix, operations[i + 1].matrix, gray, sample_type)) {
+				const string name = operation.name + "+" + operations[i + 1].name;
+				const vector<double> matrix = compose_filters(operation.matrix, operations[i + 1].matrix);
+				operations.erase(operations.begin() + i, operations.begin() + i + 2);
+				operations.insert(operations.begin() + i, Operation{name, OperationKind::POINT, matrix, 0, false,
+					[matrix](const ImageMatrix& image) { return image.filter(matrix.data()); }, nullptr});
+				changed = true;
+				break;
+			}
+			gray = operation.makes_gray || (gray && (operation.matrix.empty()
+				|| filter_keeps_gray(operation.matrix.data(), sample_type)));
+		}
+		optimized |= changed;
+	}
+	return optimized;
+}
+
+
+ImageMatrix* Pipeline::run(const ImageMatrix& image) const {
+	if (operations.empty()) {
+		return new ImageMatrix(image);
+	}
+	Pipeline rest;
+	rest.operations.assign(operations.begin() + 1, operations.end());
+	return rest.run_in_place(operations[0].apply(image));
+}
+
+
+ImageMatrix* Pipeline::run_in_place(ImageMatrix* image) const {
+	ImageMatrix* result = image;
+	for (const Operation& operation : operations) {
+		if (!operation.matrix.empty() && result->filter_in_place(operation.matrix.data())) {
+			continue;
+		}
+		ImageMatrix* temp = operation.apply(*result);
+		delete result;
+		result = temp;
+	}
+	return result;
+}
+
+
+void Pipeline::output_size(int& width, int& height) const {
+	for (const Operation& operation : operations) {
+		if (operation.stage) {
+			const unique_ptr<ResampleStage> stage(operation.stage(width, height));
+			width = stage->getWidth();
+			height = stage->getHeight();
+		}
+	}
+}
+
+
+int Pipeline::halo() const {
+	int rows = 0;
+	for (const Operation& operation : operations) {
+		rows += operation.radius;
+	}
+	return rows;
+}
+
+
+bool Pipeline::streamable(const BorderMode& border) const {
+	for (const Operation& operation : operations) {
+		if (operation.kind == OperationKind::RESAMPLE && !operation.stage) {
+			return false;
+		}
+	}
+	return border != BorderMode::WRAP || halo() == 0;
+}
+
+
+void Pipeline::stream(RowReader& reader, RowWriter& writer, const int& band_rows) const {
+	const auto resample = find_if(operations.begin(), operations.end(), [](const Operation& operation) {
+		return operation.kind == OperationKind::RESAMPLE;
+	});
+	if (resample != operations.end()) {
+		Pipeline before;
+		Pipeline after;
+		before.operations.assign(operations.begin(), resample);
+		after.operations.assign(resample + 1, operations.end());
+		unique_ptr<ResampleStage> stage(resample->stage(reader.getWidth(), reader.getHeight()));
+		before.stream(reader, *stage, band_rows);
+		stage->finish();
+		after.stream(*stage, writer, band_rows);
+		return;
+	}
+	const int width = reader.getWidth();
+	const int height = reader.getHeight();
+	const int halo_rows = halo();
+	// Bands much shorter than their halo would mostly recompute rows of their neighbors
+	const size_t row_bytes = static_cast<size_t>(width) * reader.getBpp() * sample_size(reader.getSampleType());
+	const int rows = max(STREAM_HALO_FACTOR * max(halo_rows, 1),
+		band_rows > 0 ? band_rows : static_cast<int>(STREAM_BAND_BYTES / max<size_t>(row_bytes, 1)));
+	// Input rows [input_first, input_last) of the previous band, kept for their halo
+	const ImageMatrix* input = nullptr;
+	int input_first = 0;
+	int input_last = 0;
+	for (int first = 0; first < height;) {
+		// The last band takes the rows that would make up a shorter band after it, so no
+		// band is small enough for an operation to pick a different backend than for the
+		// whole image
+		const int last = height - first < 2 * rows ? height : first + rows;
+		// Rows near the top and bottom of a band that are not the edges of the image read
+		// from rows outside the band, so each stencil spoils its radius of them. The halo
+		// covers all of that, and only rows that every stencil computed correctly are kept.
+		// At the edges of the image, the stencils see the true border.
+		const int band_first = max(0, first - halo_rows);
+		const int band_last = min(height, last + halo_rows);
+		auto* band = new ImageMatrix(width, band_last - band_first, reader.getBpp(), 0, reader.getSampleType());
+		const int kept = max(0, input_last - band_first);
+		for (int i = 0; i < kept; i++) {
+			memcpy(band->getRow(i), input->getRow(band_first - input_first + i),
+				static_cast<size_t>(width) * band->getPixelBytes());
+		}
+		reader.read(*band, kept, band_last - band_first - kept);
+		delete input;
+		input = nullptr;
+		const ImageMatrix* output;
+		if (halo_rows > 0) {
+			// The next band starts with the last rows of this one, so it must stay as it is
+			input = band;
+			input_first = band_first;
+			input_last = band_last;
+			output = run(*band);
+		}
+		else {
+			output = run_in_place(band);
+		}
+		writer.write(*output, first - band_first, last - first);
+		delete output;
+		first = last;
+	}
+	delete input;
+}
+
+
+void MatrixReader::read(ImageMatrix& rows, const int& first, const int& count) {
+	const size_t row_bytes = static_cast<size_t>(image.getWidth()) * image.getPixelBytes();
+	for (int i = 0; i < count; i++) {
+		memcpy(rows.getRow(first + i), image.getRow(next++), row_bytes);
+	}
+}
+
+
+void MatrixWriter::write(const ImageMatrix& rows, const int& first, const int& count) {
+	if (image == nullptr) {
+		image = new ImageMatrix(rows.getWidth(), height, rows.getBpp(), 0, rows.getSampleType());
+	}
+	const size_t row_bytes = static_cast<size_t>(rows.getWidth()) * rows.getPixelBytes();
+	for (int i = 0; i < count; i++) {
+		memcpy(image->getRow(next++), rows.getRow(first + i), row_bytes);
+	}
+}
+
+
+ImageMatrix* MatrixWriter::release() {
+	ImageMatrix* result = image;
+	image = nullptr;
+	return result;
+}
+
+
+string Pipeline::describe() const {
+	if (operations.empty()) {
+		return "(nothing)";
+	}
+	string text;
+	for (const Operation& operation : operations) {
+		text += (text.empty() ? "" : ", ") + operation.name;
+	}
+	return text;
+}
@@ -0,0 +1,267 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "util.h"
+
+/**
+ * Determines how the output pixels of an operation depend on its input
+*/
+enum class OperationKind {
+	POINT,	// Each output pixel depends only on the input pixel at the same position
+	STENCIL,	// Each output pixel depends on a neighborhood of input pixels
+	RESAMPLE	// The output has a different size than the input
+};
+
+
+class ResampleStage;
+
+
+/**
+ * One operation of a pipeline. Point operations that are a filter matrix keep it, so the
+ * optimizer can combine and remove them without touching any pixels.
+*/
+struct Operation {
+	std::string name;	// The name shown in the plan, such as the subcommand
+	OperationKind kind;	// How output pixels depend on the input
+	std::vector<double> matrix;	// The filter matrix of a point operation, or empty
+	int radius;	// How many rows and columns beyond an output pixel a stencil reads
+	bool makes_gray;	// Whether the output is gray whatever the input is
+	std::function<ImageMatrix*(const ImageMatrix&)> apply;	// Runs the operation on an image
+	std::function<ResampleStage*(const int&, const int&)> stage;	// Creates a resample's stage for an input size, or empty
+};
+
+
+/**
+ * Supplies the rows of an image from top to bottom, each row once
+*/
+class RowReader {
+public:
+	virtual ~RowReader() {}
+
+	virtual int getWidth() const = 0;
+	virtual int getHeight() const = 0;
+	virtual int getBpp() const = 0;
+	virtual SampleType getSampleType() const = 0;
+
+	/**
+	 * Reads the next rows of the image
+	 * @param rows The image to read into, as wide as the image and of the same format
+	 * @param first The first row of rows to overwrite
+	 * @param count The number of rows to read
+	 */
+	virtual void read(ImageMatrix& rows, const int& first, const int& count) = 0;
+};
+
+
+/**
+ * Takes the rows of an image from top to bottom, each row once
+*/
+class RowWriter {
+public:
+	virtual ~RowWriter() {}
+
+	/**
+	 * Writes the next rows of the image
+	 * @param rows The image holding the rows
+	 * @param first The first row of rows to write
+	 * @param count The number of rows to write
+	 */
+	virtual void write(const ImageMatrix& rows, const int& first, const int& count) = 0;
+
+	/**
+	 * Completes the image after its last row was written
+	 */
+	virtual void finish() {}
+};
+
+
+/**
+ * A resample done in two passes over the rows: it takes every input row as a writer before
+ * it gives any output row as a reader
+*/
+class ResampleStage : public RowReader, public RowWriter {};
+
+
+/**
+ * Reads the rows of an image in memory
+*/
+class MatrixReader : public RowReader {
+	const ImageMatrix& image;	// The image
+	int next;	// The next row to read
+
+public:
+	/**
+	 * Starts reading at the top of an image
+	 * @param image The image, which must outlive the reader
+	 */
+	explicit MatrixReader(const ImageMatrix& image) : image(image), next(0) {}
+
+	int getWidth() const override { return image.getWidth(); }
+	int getHeight() const override { return image.getHeight(); }
+	int getBpp() const override { return image.getBpp(); }
+	SampleType getSampleType() const override { return image.getSampleType(); }
+
+	void read(ImageMatrix& rows, const int& first, const int& count) override;
+};
+
+
+/**
+ * Collects written rows into an image in memory, which is created by the first write
+*/
+class MatrixWriter : public RowWriter {
+	ImageMatrix* image;	// The image, or null before the first write
+	int height;	// The height of the image
+	int next;	// The next row to write
+
+public:
+	/**
+	 * Creates a writer for an image
+	 * @param height The height of the image
+	 */
+	explicit MatrixWriter(const int& height) : image(nullptr), height(height), next(0) {}
+	MatrixWriter(const MatrixWriter& writer) = delete;
+	MatrixWriter& operator=(const MatrixWriter& writer) = delete;
+	~MatrixWriter() override { delete image; }
+
+	void write(const ImageMatrix& rows, const int& first, const int& count) override;
+
+	/**
+	 * Hands over the image
+	 * @return The image, which the caller deletes
+	 */
+	ImageMatrix* release();
+};
+
+
+/**
+ * A chain of operations that only runs when its output is requested. Until then it is a
+ * plan, which the optimizer can simplify before any pixel is processed.
+*/
+class Pipeline {
+	std::vector<Operation> operations;	// The operations, in the order they run
+
+public:
+	const std::vector<Operation>& getOperations() const { return operations; }
+
+	/**
+	 * Appends an operation
+	 * @param name The name shown in the plan
+	 * @param kind How output pixels depend on the input
+	 * @param apply Runs the operation on an image
+	 */
+	void add(const std::string& name, const OperationKind& kind,
+		const std::function<ImageMatrix*(const ImageMatrix&)>& apply);
+
+	/**
+	 * Appends an operation, such as one of another pipeline
+	 * @param operation The operation
+	 */
+	void add(const Operation& operation);
+
+	/**
+	 * Appends a stencil
+	 * @param name The name shown in the plan
+	 * @param radius How many rows and columns beyond an output pixel the stencil reads
+	 * @param apply Runs the operation on an image
+	 */
+	void add_stencil(const std::string& name, const int& radius,
+		const std::function<ImageMatrix*(const ImageMatrix&)>& apply);
+
+	/**
+	 * Appends a resample that can also run as a stage of a streaming pipeline
+	 * @param name The name shown in the plan
+	 * @param apply Runs the operation on an image
+	 * @param stage Creates the stage for an input image of the given width and height
+	 */
+	void add_resample(const std::string& name, const std::function<ImageMatrix*(const ImageMatrix&)>& apply,
+		const std::function<ResampleStage*(const int&, const int&)>& stage);
+
+	/**
+	 * Appends an operation whose output is gray whatever the input is
+	 * @param name The name shown in the plan
+	 * @param apply Runs the operation on an image
+	 */
+	void add_gray(const std::string& name, const std::function<ImageMatrix*(const ImageMatrix&)>& apply);
+
+	/**
+	 * Appends a point operation that is a filter matrix
+	 * @param name The name shown in the plan
+	 * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+	 */
+	void add_filter(const std::string& name, const std::vector<double>& matrix);
+
+	/**
+	 * Simplifies the pipeline without changing its output. Identity filters are removed,
+	 * and neighboring filters are multiplied into one where that gives the same samples:
+	 * always for float samples, which are neither clamped nor rounded in between, and for
+	 * integer samples if the first filter is exact or the second only selects channels.
+	 * @param bpp Channels per pixel of the input image
+	 * @param sample_type The sample type of the input image
+	 * @return Whether the pipeline changed
+	 */
+	bool optimize(const int& bpp, const SampleType& sample_type);
+
+	/**
+	 * Runs every operation, deleting each intermediate image once the next one is done.
+	 * Filters that keep the channels of an intermediate image overwrite it.
+	 * @param image The input image
+	 * @return The output image, which is a copy if there are no operations
+	 */
+	ImageMatrix* run(const ImageMatrix& image) const;
+
+	/**
+	 * Runs every operation on an image that is not needed afterwards, so filters that keep
+	 * its channels overwrite it instead of allocating a new image
+	 * @param image The input image, which the pipeline deletes or returns
+	 * @return The output image
+	 */
+	ImageMatrix* run_in_place(ImageMatrix* image) const;
+
+	/**
+	 * Finds the size of the output of stream, which only resample stages change
+	 * @param width The width of the input, overridden with the width of the output
+	 * @param height The height of the input, overridden with the height of the output
+	 */
+	void output_size(int& width, int& height) const;
+
+	/**
+	 * Returns how many rows above and below a band of output rows the pipeline reads:
+	 * the sum of the radii of its stencils
+	 * @return The halo in rows
+	 */
+	int halo() const;
+
+	/**
+	 * Checks whether the pipeline can run one band of rows at a time. A resample without a
+	 * stage reads the whole image, and so does a stencil wrapping around the image.
+	 * @param border The border mode of the stencils
+	 * @return Whether stream can run the pipeline
+	 */
+	bool streamable(const BorderMode& border) const;
+
+	/**
+	 * Runs the pipeline one band of rows at a time, so only a band and its halo of each
+	 * intermediate image exist at once. Every band reads its halo rows along with it and
+	 * drops them from the output, so the result equals that of run; the halo rows are kept
+	 * from one band to the next, so each input row is read once. The operations before a
+	 * resample stream into its stage, and the ones after it stream out of the stage.
+	 * @param reader Supplies the input rows
+	 * @param writer Takes the output rows
+	 * @param band_rows Output rows per band, or 0 to pick a size of a few megabytes; bands are
+	 * never shorter than a few times the halo
+	 */
+	void stream(RowReader& reader, RowWriter& writer, const int& band_rows) const;
+
+	/**
+	 * Lists the operations in one line, with combined filters joined by a plus sign, such
+	 * as "sharpen, sepia+contrast"
+	 * @return The list
+	 */
+	std::string describe() const;
+};
+
+
+#endif
@@ -0,0 +1,208 @@
+#include "result_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+using namespace std;
+
+
+constexpr size_t HASH_CHUNK_SIZE = 1 << 20;	// Bytes of a file hashed at a time
+constexpr uint64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ull;	// Odd constant that spreads the bits of each word
+
+
+namespace {
+
+std::mutex pending_mutex;	// Guards pending_paths
+vector<string> pending_paths;	// Temporary files not committed yet, removed if the run exits first
+atomic<unsigned> temporary_count{0};	// Tells apart the temporary files of one process
+
+
+/**
+ * Removes the temporary files that were never committed, so a failed run leaves none behind
+ */
+void remove_pending_paths() {
+	lock_guard<std::mutex> lock(pending_mutex);
+	for (const string& path : pending_paths) {
+		remove(path.c_str());
+	}
+	pending_paths.clear();
+}
+
+
+/**
+ * Keeps a temporary file from being removed at exit
+ * @param path The path of the file
+ */
+void forget_pending_path(const string& path) {
+	lock_guard<std::mutex> lock(pending_mutex);
+	pending_paths.erase(remove(pending_paths.begin(), pending_paths.end(), path), pending_paths.end());
+}
+
+
+/**
+ * Reports a cache entry that cannot be read or written and exits
+ * @param path The path of the entry
+ */
+[[noreturn]] void cache_failed(const string& path) {
+	cout << "Could not access cache: " << path << endl;
+	exit(2);
+}
+
+
+/**
+ * Copies a file
+ * @param source_path The path of the file
+ * @param dest_path The path of the copy, which is replaced
+ */
+void copy_file(const string& source_path, const string& dest_path) {
+	FILE* source = fopen(source_path.c_str(), "rb");
+	if (source == nullptr) {
+		cache_failed(source_path);
+	}
+	FILE* dest = fopen(dest_path.c_str(), "wb");
+	if (dest == nullptr) {
+		cache_failed(dest_path);
+	}
+	vector<char> buffer(HASH_CHUNK_SIZE);
+	size_t count;
+	while ((count = fread(&buffer[0], 1, buffer.size(), source)) > 0) {
+		if (fwrite(&buffer[0], 1, count, dest) != count) {
+			cache_failed(dest_path);
+		}
+	}
+	fclose(source);
+	if (fclose(dest) != 0) {
+		cache_failed(dest_path);
+	}
+}
+
+
+/**
+ * Mixes the bits of a hash so every input bit affects every output bit
+ * @param hash The hash
+ * @return The mixed hash
+ */
+uint64_t finish_hash(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	return hash ^ hash >> 33;
+}
+
+}
+
+
+ResultCache::ResultCache(const string& directory) : directory(directory) {
+	if (!this->directory.empty() && this->directory.back() != '/') {
+		this->directory += '/';
+	}
+}
+
+
+string ResultCache::path(const string& key, const string& extension) const {
+	return directory + key + "." + extension;
+}
+
+
+string ResultCache::temporary_path(const string& key, const string& extension) const {
+	// Every writer gets a name of its own, so runs sharing the cache never write the same
+	// file, and the extension stays last, since it picks the format of the file
+#ifdef _WIN32
+	const long process = _getpid();
+#else
+	const long process = getpid();
+#endif
+	const string path = directory + key + ".tmp" + to_string(process) + "-" + to_string(temporary_count++)
+		+ "." + extension;
+	static const int registered = atexit(remove_pending_paths);
+	(void)registered;
+	lock_guard<std::mutex> lock(pending_mutex);
+	pending_paths.push_back(path);
+	return path;
+}
+
+
+bool ResultCache::contains(const string& key, const string& extension) const {
+	FILE* file = fopen(path(key, extension).c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+
+void ResultCache::commit(const string& temporary, const string& key, const string& extension) const {
+	if (rename(temporary.c_str(), path(key, extension).c_str()) != 0) {
+		// Where rename does not replace files, another run may have committed the entry first
+		if (!contains(key, extension)) {
+			cache_failed(path(key, extension));
+		}
+		remove(temporary.c_str());
+	}
+	forget_pending_path(temporary);
+}
+
+
+void ResultCache::store(const string& file_path, const string& key, const string& extension) const {
+	const string temporary = temporary_path(key, extension);
+	copy_file(file_path, temporary);
+	commit(temporary, key, extension);
+}
+
+
+void ResultCache::fetch(const string& key, const string& extension, const string& file_path) const {
+	copy_file(path(key, extension), file_path);
+}
+
+
+uint64_t hash_bytes(const void* data, const size_t& size, const uint64_t& seed) {
+	const auto* bytes = static_cast<const uint8_t*>(data);
+	uint64_t hash = seed ^ (size * HASH_MULTIPLIER);
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * HASH_MULTIPLIER;
+		hash ^= hash >> 29;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size - i);
+	hash = (hash ^ tail) * HASH_MULTIPLIER;
+	return finish_hash(hash);
+}
+
+
+uint64_t hash_file(const string& path) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		cout << "Could not read image: " << path << endl;
+		exit(2);
+	}
+	vector<uint8_t> buffer(HASH_CHUNK_SIZE);
+	uint64_t hash = 0;
+	size_t count;
+	while ((count = fread(&buffer[0], 1, buffer.size(), file)) > 0) {
+		hash = hash_bytes(&buffer[0], count, hash);
+	}
+	fclose(file);
+	return hash;
+}
+
+
+string cache_key(const uint64_t& input_hash, const string& description) {
+	const uint64_t hash = hash_bytes(description.data(), description.size(), input_hash);
+	char digits[17];
+	snprintf(digits, sizeof(digits), "%016llx", static_cast<unsigned long long>(hash));
+	return digits;
+}
@@ -0,0 +1,102 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * A directory of files named by the hash of what made them, so a run that would make the
+ * same file again can copy it instead. Entries are written under a temporary name and
+ * renamed once complete, so an interrupted run never leaves a partial entry behind.
+*/
+class ResultCache {
+	std::string directory;	// The directory holding the entries
+
+public:
+	/**
+	 * Opens a cache directory, which must exist
+	 * @param directory The path of the directory
+	 */
+	explicit ResultCache(const std::string& directory);
+
+	/**
+	 * Returns the path of an entry, whether it exists or not
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry, which tells its format
+	 * @return The path
+	 */
+	std::string path(const std::string& key, const std::string& extension) const;
+
+	/**
+	 * Returns a new path to write an entry to before commit moves it into place. No other
+	 * call or process gets the same path, and the file is removed if the process exits
+	 * before it is committed.
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry
+	 * @return The path
+	 */
+	std::string temporary_path(const std::string& key, const std::string& extension) const;
+
+	/**
+	 * Checks whether an entry exists
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry
+	 * @return Whether the entry exists
+	 */
+	bool contains(const std::string& key, const std::string& extension) const;
+
+	/**
+	 * Moves a file written to a temporary path of an entry into place
+	 * @param temporary The temporary path, as returned by temporary_path
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry
+	 */
+	void commit(const std::string& temporary, const std::string& key, const std::string& extension) const;
+
+	/**
+	 * Stores a copy of a file as an entry
+	 * @param file_path The path of the file
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry
+	 */
+	void store(const std::string& file_path, const std::string& key, const std::string& extension) const;
+
+	/**
+	 * Copies an entry to a file
+	 * @param key The key of the entry
+	 * @param extension The file extension of the entry
+	 * @param file_path The path of the file
+	 */
+	void fetch(const std::string& key, const std::string& extension, const std::string& file_path) const;
+};
+
+
+/**
+ * Hashes bytes eight at a time; fast, but not meant to resist deliberate collisions
+ * @param data The bytes
+ * @param size The number of bytes
+ * @param seed Starts the hash, so hashes can be chained
+ * @return The hash
+*/
+std::uint64_t hash_bytes(const void* data, const std::size_t& size, const std::uint64_t& seed);
+
+
+/**
+ * Hashes the contents of a file
+ * @param path The path of the file
+ * @return The hash
+*/
+std::uint64_t hash_file(const std::string& path);
+
+
+/**
+ * Makes the key of a cache entry
+ * @param input_hash The hash of the input the entry was made from
+ * @param description Everything else the entry depends on, such as the functions and their options
+ * @return The key, as hexadecimal digits
+*/
+std::string cache_key(const std::uint64_t& input_hash, const std::string& description);
+
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <algorithm>
+#include <cstdint>
+#include "convolution.h"
+#include "util.h"
+
+/*
+ * Convolution with small kernels whose integer weights are template parameters. Every
+ * tap is unrolled into a multiplication by a constant, so taps with a zero weight
+ * disappear at compile time and the rest vectorize without any loop over the kernel.
+ */
+
+
+/**
+ * Convolves every plane with a 3x3 kernel, in cache-sized tiles. The weights are the
+ * template parameters, stored by rows, and the result is clamped to the byte range.
+ * @param source The source image, whose border is at least one pixel wide and filled
+ * @param dest The destination image
+*/
+template <int W00, int W01, int W02, int W10, int W11, int W12, int W20, int W21, int W22>
+void convolve_stencil(const PlanarImage& source, PlanarImage& dest) {
+	int tile_width, tile_height;
+	convolution_tile_size(1, 1, tile_width, tile_height);
+	for_each_tile(source, tile_width, tile_height, [&](int c, int x, int y, int columns, int rows) {
+		for (int i = y; i < y + rows; i++) {
+			// The top row of the kernel weighs the pixels below, and its left column the
+			// pixels to the right
+			const std::uint8_t* below = source.getRow(c, i + 1) + x;
+			const std::uint8_t* row = source.getRow(c, i) + x;
+			const std::uint8_t* above = source.getRow(c, i - 1) + x;
+			std::uint8_t* new_row = dest.getRow(c, i) + x;
+			for (int j = 0; j < columns; j++) {
+				const std::int32_t total =
+					W00 * below[j + 1] + W01 * below[j] + W02 * below[j - 1]
+					+ W10 * row[j + 1] + W11 * row[j] + W12 * row[j - 1]
+					+ W20 * above[j + 1] + W21 * above[j] + W22 * above[j - 1];
+				new_row[j] = static_cast<std::uint8_t>(std::min(255, std::max(0, total)));
+			}
+		}
+	});
+}
+
+
+/**
+ * Adds each element of the image to its local neighbors, weighted by a 3x3 kernel whose
+ * weights are the template parameters, stored by rows. Alpha is kept as it is.
+ * Images with 16-bit or float samples are convolved by ImageMatrix::convolve.
+ * @param image The image
+ * @param border Determines the values of neighbors outside of the image
+ * @return The output image
+*/
+template <int W00, int W01, int W02, int W10, int W11, int W12, int W20, int W21, int W22>
+ImageMatrix* stencil(const ImageMatrix& image, const BorderMode& border) {
+	if (image.getSampleType() != SampleType::U8) {
+		// Wider samples take the floating-point path of a general convolution
+		constexpr double kernel[] = {W00, W01, W02, W10, W11, W12, W20, W21, W22};
+		return image.convolve(kernel, 9, 1.0, border);
+	}
+	const int width = image.getWidth();
+	const int height = image.getHeight();
+	const PlanarImage source(image, color_channels(image.getBpp()), 1);
+	source.fill_border(border);
+	PlanarImage dest(width, height, source.getChannels(), 0);
+	convolve_stencil<W00, W01, W02, W10, W11, W12, W20, W21, W22>(source, dest);
+	auto* new_image = new ImageMatrix(width, height, image.getBpp());
+	dest.interleave(*new_image);
+	if (has_alpha(image.getBpp())) {
+		copy_alpha(image, *new_image);
+	}
+	return new_image;
+}
+
+
+#endif
@@ -0,0 +1,246 @@
+#include "tiled_image.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+
+constexpr int TILE_SIZE = 256;	// Width and height of the tiles of new tiled images
+constexpr int HEADER_SIZE = 28;	// Bytes in front of the index: the magic number and five numbers
+constexpr size_t DEFAULT_CACHE_BUDGET = 256 << 20;	// Memory for tiles unless set otherwise
+
+const char TILED_MAGIC[8] = { 'I', 'P', 'T', 'I', 'L', 'E', 'S', '1' };	// Signature at the start of a tiled image
+
+
+namespace {
+
+size_t cache_budget = DEFAULT_CACHE_BUDGET;	// Memory for the tiles of each tiled image
+
+
+/**
+ * Reports a tiled image that cannot be read or written and exits
+ * @param path The path of the image
+ */
+[[noreturn]] void tiles_failed(const string& path) {
+	cout << "Could not access tiled image: " << path << endl;
+	exit(2);
+}
+
+
+/**
+ * Encodes a number in little-endian order
+ * @param bytes The bytes to write to
+ * @param value The number
+ * @param count The number of bytes
+ */
+void put_number(uint8_t* bytes, const uint64_t& value, const int& count) {
+	for (int i = 0; i < count; i++) {
+		bytes[i] = static_cast<uint8_t>(value >> (i * 8));
+	}
+}
+
+
+/**
+ * Decodes a number in little-endian order
+ * @param bytes The bytes, least significant first
+ * @param count The number of bytes
+ */
+uint64_t get_number(const uint8_t* bytes, const int& count) {
+	uint64_t value = 0;
+	for (int i = count - 1; i >= 0; i--) {
+		value = value << 8 | bytes[i];
+	}
+	return value;
+}
+
+}
+
+
+TiledImage::TiledImage(const string& path, FILE* file, const int& width, const int& height, const int& bpp,
+	const SampleType& sample_type, const int& tile_size) :
+	path(path), file(file), width(width), height(height), bpp(bpp), sample_type(sample_type), tile_size(tile_size),
+	index_dirty(false) {
+	tiles_across = (width + tile_size - 1) / tile_size;
+	index.assign(static_cast<size_t>(tiles_across) * ((height + tile_size - 1) / tile_size), 0);
+	file_end = HEADER_SIZE + index.size() * 8;
+	const size_t tile_bytes = static_cast<size_t>(tile_size) * tile_size * bpp * sample_size(sample_type);
+	cache_tiles = max(static_cast<size_t>(tiles_across), cache_budget / tile_bytes);
+}
+
+
+TiledImage* TiledImage::create(const string& path, const int& width, const int& height, const int& bpp,
+	const SampleType& sample_type) {
+	FILE* file = fopen(path.c_str(), "w+b");
+	if (file == nullptr) {
+		tiles_failed(path);
+	}
+	auto* image = new TiledImage(path, file, width, height, bpp, sample_type, TILE_SIZE);
+	image->index_dirty = true;
+	return image;
+}
+
+
+TiledImage* TiledImage::open(const string& path) {
+	FILE* file = fopen(path.c_str(), "r+b");
+	if (file == nullptr) {
+		file = fopen(path.c_str(), "rb");
+	}
+	uint8_t header[HEADER_SIZE];
+	if (file == nullptr || fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE
+		|| memcmp(header, TILED_MAGIC, sizeof(TILED_MAGIC)) != 0) {
+		tiles_failed(path);
+	}
+	const int width = static_cast<int>(get_number(header + 8, 4));
+	const int height = static_cast<int>(get_number(header + 12, 4));
+	const int bpp = static_cast<int>(get_number(header + 16, 4));
+	const uint64_t type = get_number(header + 20, 4);
+	const int tile_size = static_cast<int>(get_number(header + 24, 4));
+	if (width <= 0 || height <= 0 || bpp < 1 || bpp > 4 || type > 2 || tile_size <= 0) {
+		tiles_failed(path);
+	}
+	auto* image = new TiledImage(path, file, width, height, bpp, static_cast<SampleType>(type), tile_size);
+	vector<uint8_t> index_bytes(image->index.size() * 8);
+	if (fread(&index_bytes[0], 1, index_bytes.size(), file) != index_bytes.size()) {
+		tiles_failed(path);
+	}
+	const uint64_t tile_bytes = static_cast<uint64_t>(tile_size) * tile_size * bpp * sample_size(image->sample_type);
+	for (size_t i = 0; i < image->index.size(); i++) {
+		image->index[i] = get_number(&index_bytes[i * 8], 8);
+		if (image->index[i] != 0) {
+			image->file_end = max(image->file_end, image->index[i] + tile_bytes);
+		}
+	}
+	return image;
+}
+
+
+TiledImage::~TiledImage() {
+	for (Tile& cached_tile : tiles) {
+		if (cached_tile.dirty) {
+			store(cached_tile);
+		}
+	}
+	if (index_dirty) {
+		vector<uint8_t> bytes(HEADER_SIZE + index.size() * 8);
+		memcpy(&bytes[0], TILED_MAGIC, sizeof(TILED_MAGIC));
+		put_number(&bytes[8], width, 4);
+		put_number(&bytes[12], height, 4);
+		put_number(&bytes[16], bpp, 4);
+		put_number(&bytes[20], static_cast<uint64_t>(sample_type), 4);
+		put_number(&bytes[24], tile_size, 4);
+		for (size_t i = 0; i < index.size(); i++) {
+			put_number(&bytes[HEADER_SIZE + i * 8], index[i], 8);
+		}
+		if (!seek_file(file, 0) || fwrite(&bytes[0], 1, bytes.size(), file) != bytes.size()) {
+			tiles_failed(path);
+		}
+	}
+	if (fclose(file) != 0) {
+		tiles_failed(path);
+	}
+}
+
+
+void TiledImage::store(Tile& tile) {
+	if (index[tile.number] == 0) {
+		index[tile.number] = file_end;
+		file_end += tile.samples.size();
+		index_dirty = true;
+	}
+	if (!seek_file(file, index[tile.number])
+		|| fwrite(&tile.samples[0], 1, tile.samples.size(), file) != tile.samples.size()) {
+		tiles_failed(path);
+	}
+	tile.dirty = false;
+}
+
+
+TiledImage::Tile& TiledImage::tile(const int& number) {
+	const auto found = cached.find(number);
+	if (found != cached.end()) {
+		tiles.splice(tiles.begin(), tiles, found->second);
+		return tiles.front();
+	}
+	if (tiles.size() >= cache_tiles) {
+		// Reuse the buffer of the least recently used tile
+		Tile& oldest = tiles.back();
+		if (oldest.dirty) {
+			store(oldest);
+		}
+		cached.erase(oldest.number);
+		tiles.splice(tiles.begin(), tiles, prev(tiles.end()));
+	}
+	else {
+		tiles.push_front(Tile{0, vector<uint8_t>(static_cast<size_t>(tile_size) * tile_size * bpp
+			* sample_size(sample_type)), false});
+	}
+	Tile& new_tile = tiles.front();
+	new_tile.number = number;
+	new_tile.dirty = false;
+	if (index[number] == 0) {
+		fill(new_tile.samples.begin(), new_tile.samples.end(), 0);
+	}
+	else if (!seek_file(file, index[number])
+		|| fread(&new_tile.samples[0], 1, new_tile.samples.size(), file) != new_tile.samples.size()) {
+		tiles_failed(path);
+	}
+	cached[number] = tiles.begin();
+	return new_tile;
+}
+
+
+template <typename F>
+void TiledImage::for_each_segment(const int& x, const int& y, const int& region_width, const int& region_height,
+	const F& visit) {
+	const size_t pixel_bytes = static_cast<size_t>(bpp) * sample_size(sample_type);
+	// Tile by tile, so each tile is looked up once per region
+	for (int tile_y = y / tile_size; tile_y * tile_size < y + region_height; tile_y++) {
+		const int top = max(y, tile_y * tile_size);
+		const int bottom = min(y + region_height, (tile_y + 1) * tile_size);
+		for (int tile_x = x / tile_size; tile_x * tile_size < x + region_width; tile_x++) {
+			const int left = max(x, tile_x * tile_size);
+			const int right = min(x + region_width, (tile_x + 1) * tile_size);
+			Tile& current = tile(tile_y * tiles_across + tile_x);
+			for (int i = top; i < bottom; i++) {
+				const size_t offset = (static_cast<size_t>(i - tile_y * tile_size) * tile_size
+					+ (left - tile_x * tile_size)) * pixel_bytes;
+				visit(current, offset, i - y, left - x, (right - left) * pixel_bytes);
+			}
+		}
+	}
+}
+
+
+void TiledImage::read(ImageMatrix& region, const int& x, const int& y) {
+	const size_t pixel_bytes = region.getPixelBytes();
+	for_each_segment(x, y, region.getWidth(), region.getHeight(),
+		[&](Tile& segment_tile, const size_t& offset, const int& row, const int& column, const size_t& bytes) {
+			memcpy(region.getRow(row) + column * pixel_bytes, &segment_tile.samples[offset], bytes);
+		});
+}
+
+
+void TiledImage::write(const ImageMatrix& region, const int& x, const int& y) {
+	const size_t pixel_bytes = region.getPixelBytes();
+	for_each_segment(x, y, region.getWidth(), region.getHeight(),
+		[&](Tile& segment_tile, const size_t& offset, const int& row, const int& column, const size_t& bytes) {
+			memcpy(&segment_tile.samples[offset], region.getRow(row) + column * pixel_bytes, bytes);
+			segment_tile.dirty = true;
+		});
+}
+
+
+void set_tile_cache_budget(const size_t& bytes) {
+	cache_budget = bytes;
+}
+
+
+bool seek_file(FILE* file, const uint64_t& position) {
+	// long is 32 bits on Windows, so fseek cannot reach past 2 GB there
+#ifdef _WIN32
+	return _fseeki64(file, static_cast<__int64>(position), SEEK_SET) == 0;
+#else
+	return fseeko(file, static_cast<off_t>(position), SEEK_SET) == 0;
+#endif
+}
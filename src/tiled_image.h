@@ -0,0 +1,138 @@
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util.h"
+
+/**
+ * An image stored on disk as square tiles of raw samples, of which only the recently used
+ * ones are kept in memory. The file starts with a header and an index that holds the
+ * position of every tile in the file. Tiles are appended when they are first stored, and
+ * a tile that was never stored reads as zeros.
+*/
+class TiledImage {
+	/**
+	 * A tile in memory
+	 */
+	struct Tile {
+		int number;	// The position of the tile in the index, row by row
+		std::vector<std::uint8_t> samples;	// The samples, row by row
+		bool dirty;	// Whether the samples differ from the file
+	};
+
+	std::string path;	// The path of the file
+	std::FILE* file;	// The file
+	int width;	// The width of the image
+	int height;	// The height of the image
+	int bpp;	// Channels per pixel
+	SampleType sample_type;	// The sample type
+	int tile_size;	// The width and height of a tile
+	int tiles_across;	// The number of tiles along the width
+	std::vector<std::uint64_t> index;	// The position of each tile in the file, or 0 if not stored
+	std::uint64_t file_end;	// The position in the file where the next new tile goes
+	bool index_dirty;	// Whether the index differs from the file
+	std::size_t cache_tiles;	// The number of tiles to keep in memory
+	std::list<Tile> tiles;	// The tiles in memory, the most recently used first
+	std::unordered_map<int, std::list<Tile>::iterator> cached;	// The tiles in memory by number
+
+	TiledImage(const std::string& path, std::FILE* file, const int& width, const int& height, const int& bpp,
+		const SampleType& sample_type, const int& tile_size);
+
+	/**
+	 * Returns a tile, reading it into memory if it is not there. Once the cache is over
+	 * budget, the least recently used tile is dropped, after storing it if it changed.
+	 * @param number The position of the tile in the index
+	 * @return The tile, valid until the next call
+	 */
+	Tile& tile(const int& number);
+
+	/**
+	 * Writes a tile to its place in the file
+	 */
+	void store(Tile& tile);
+
+	/**
+	 * Calls a function on every row segment of a region, with the tile that holds it
+	 * @param x The left column of the region
+	 * @param y The top row of the region
+	 * @param width The width of the region
+	 * @param height The height of the region
+	 * @param visit Called with the tile, the offset of the segment in the tile, the row of
+	 * the region and the column of the region it starts at, and its length in pixels
+	 */
+	template <typename F>
+	void for_each_segment(const int& x, const int& y, const int& width, const int& height, const F& visit);
+
+public:
+	/**
+	 * Creates a tiled image file; every pixel is zero until it is written
+	 * @param path The path of the file
+	 * @param width The width of the image
+	 * @param height The height of the image
+	 * @param bpp Channels per pixel
+	 * @param sample_type The sample type
+	 * @return The image, which the caller deletes to complete the file
+	 */
+	static TiledImage* create(const std::string& path, const int& width, const int& height, const int& bpp,
+		const SampleType& sample_type);
+
+	/**
+	 * Opens a tiled image file
+	 * @param path The path of the file
+	 * @return The image, which the caller deletes
+	 */
+	static TiledImage* open(const std::string& path);
+
+	TiledImage(const TiledImage& image) = delete;
+	TiledImage& operator=(const TiledImage& image) = delete;
+
+	/**
+	 * Stores the changed tiles and the index, and closes the file
+	 */
+	~TiledImage();
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getBpp() const { return bpp; }
+	SampleType getSampleType() const { return sample_type; }
+
+	/**
+	 * Copies a region of the image into an image in memory, paging in the tiles it covers
+	 * @param region The image to copy into, of the same format; its size is that of the region
+	 * @param x The left column of the region
+	 * @param y The top row of the region
+	 */
+	void read(ImageMatrix& region, const int& x, const int& y);
+
+	/**
+	 * Copies an image in memory into a region of the image, paging in the tiles it covers
+	 * @param region The image to copy, of the same format; its size is that of the region
+	 * @param x The left column of the region
+	 * @param y The top row of the region
+	 */
+	void write(const ImageMatrix& region, const int& x, const int& y);
+};
+
+
+/**
+ * Sets how much memory the tiles of every tiled image opened afterwards may take
+ * @param bytes The memory budget in bytes; at least one row of tiles is always kept
+*/
+void set_tile_cache_budget(const std::size_t& bytes);
+
+
+/**
+ * Moves to a position in a file, which may be beyond what a long can hold
+ * @param file The file
+ * @param position The position in bytes from the start of the file
+ * @return Whether the position could be reached
+*/
+bool seek_file(FILE* file, const std::uint64_t& position);
+
+
+#endif
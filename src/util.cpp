@@ -1,10 +1,17 @@
 #include "util.h"
+#include "buffer_pool.h"
+#include "convolution.h"
+#include "parallel.h"
 #include <iostream>
 #include <cstdint>
 #include <regex>
 #include <fstream>
+#include <sstream>
 #include <cctype>
 #include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstring>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -14,7 +21,252 @@ using namespace std;
 
 constexpr int QUALITY = 50; // JPG Image quality | 0 - 100
 
-const string valid_exts[4] = { "png", "bmp", "jpg", "jpeg" };   // Valid file extentions
+const string valid_exts[8] = { "png", "bmp", "jpg", "jpeg", "hdr", "ppm", "pgm", "pnm" };   // Valid file extentions
+
+
+constexpr int DITHER_SIZE = 8;   // Width and height of the ordered dither matrix
+constexpr int PLANAR_MIN_PIXELS = 4096;   // Smallest image that is convolved in planar layout
+constexpr double AVERAGE_TOLERANCE = 1e-6;   // Largest deviation of the weights of an averaging kernel from 1
+
+
+/**
+ * Builds a lookup table for each channel of a filter matrix in which every output
+ * channel depends only on the same input channel
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+ * @param tables Overridden with the output value of each input value, for each channel
+ * @return Whether the matrix is diagonal
+*/
+bool channel_tables(const double* matrix, uint8_t tables[3][256]) {
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++) {
+            if (k != c && matrix[c * 4 + k] != 0.0) {
+                return false;
+            }
+        }
+    }
+    // Same arithmetic as the full matrix product, so the results are identical
+    for (int c = 0; c < 3; c++) {
+        for (int value = 0; value < 256; value++) {
+            const double new_value = matrix[c * 5] * value + matrix[c * 4 + 3];
+            tables[c][value] = static_cast<uint8_t>(round(min(255.0, max(0.0, new_value))));
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Builds a lookup table for each output channel of a filter matrix applied to gray
+ * pixels, whose red, green and blue components are all equal
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+ * @param tables Overridden with the output value of each gray value, for each channel
+*/
+void gray_tables(const double* matrix, uint8_t tables[3][256]) {
+    for (int c = 0; c < 3; c++) {
+        for (int value = 0; value < 256; value++) {
+            const double* row = matrix + c * 4;
+            const double new_value = row[0] * value + row[1] * value + row[2] * value + row[3];
+            tables[c][value] = static_cast<uint8_t>(round(min(255.0, max(0.0, new_value))));
+        }
+    }
+}
+
+
+/**
+ * Checks whether a kernel is a weighted average: no negative weights, adding up to one
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @return Whether the kernel averages its taps
+*/
+bool averaging_kernel(const double* kernel, const size_t& kernel_size, const double& scalar) {
+    double sum = 0.0;
+    for (size_t i = 0; i < kernel_size; i++) {
+        if (kernel[i] * scalar < 0.0) {
+            return false;
+        }
+        sum += kernel[i] * scalar;
+    }
+    return fabs(sum - 1.0) <= AVERAGE_TOLERANCE;
+}
+
+
+/**
+ * Performs a filter matrix on an image with 16-bit or float samples. The offsets of the
+ * matrix are in 8-bit units and scale with the range of the samples.
+ * @param image The image
+ * @param new_image The output image, of the same size and sample type, with as many
+ * channels as the image or, for a gray image that becomes RGB, two more
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+*/
+template <typename T>
+void filter_samples(const ImageMatrix& image, ImageMatrix& new_image, const double* matrix) {
+    const int bpp = image.getBpp();
+    const int new_bpp = new_image.getBpp();
+    const int colors = color_channels(bpp);
+    const int new_colors = color_channels(new_bpp);
+    const double offset_scale = sample_max(image.getSampleType()) / 255.0;
+    const double offsets[3] = { matrix[3] * offset_scale, matrix[7] * offset_scale, matrix[11] * offset_scale };
+    parallel_for(image.getHeight(), [&](const int& i) {
+        const T* row = image.getSamples<T>(i);
+        T* new_row = new_image.getSamples<T>(i);
+        for (int j = 0; j < image.getWidth(); j++) {
+            const T* pixel = row + j * bpp;
+            T* new_pixel = new_row + j * new_bpp;
+            // Gray pixels are read as equal red, green and blue
+            const double r = pixel[0];
+            const double g = pixel[colors / 3];
+            const double b = pixel[2 * (colors / 3)];
+            for (int c = 0; c < new_colors; c++) {
+                const double* weights = matrix + c * 4;
+                new_pixel[c] = to_sample<T>(weights[0] * r + weights[1] * g + weights[2] * b + offsets[c]);
+            }
+            if (has_alpha(bpp)) {
+                new_pixel[new_bpp - 1] = pixel[bpp - 1];
+            }
+        }
+    });
+}
+
+
+/**
+ * Convolves an image through float planes. Every color channel is split into a float
+ * plane with a border filled according to the border mode, so each sample is converted
+ * once instead of once per tap. With a kernel that averages its taps, images with alpha
+ * are convolved in premultiplied alpha: the colors are weighted by alpha in the float
+ * planes, and divided by the convolved alpha once, with rounding, when they are stored.
+ * 8-bit images with alpha take this path too, since premultiplied 8-bit colors would
+ * lose most of their precision at low alpha.
+ * @param image The image
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @param border Determines the values of neighbors outside of the image
+ * @return The output image
+*/
+template <typename T>
+ImageMatrix* convolve_samples(const ImageMatrix& image, const double* kernel, const size_t& kernel_size,
+                              const double& scalar, const BorderMode& border) {
+    const int width = image.getWidth();
+    const int height = image.getHeight();
+    const int bpp = image.getBpp();
+    const int colors = color_channels(bpp);
+    const bool premultiplied = has_alpha(bpp) && averaging_kernel(kernel, kernel_size, scalar);
+    const int planes = premultiplied ? bpp : colors;
+    const double full = sample_max(image.getSampleType());
+    const KernelAnalysis analysis = analyze_kernel(kernel, kernel_size, scalar);
+    const int kernel_radius = analysis.kernel_rows / 2;
+    const int source_stride = width + 2 * kernel_radius;
+    const size_t source_size = static_cast<size_t>(source_stride) * (height + 2 * kernel_radius);
+    const size_t dest_size = static_cast<size_t>(width) * height;
+    vector<float> source(source_size * planes);
+    vector<float> dest(dest_size * planes);
+    // Map the border once per row and column instead of once per tap
+    vector<int> columns(source_stride);
+    for (int j = 0; j < source_stride; j++) {
+        columns[j] = border_index(j - kernel_radius, width, border);
+    }
+    parallel_for(height + 2 * kernel_radius, [&](const int& i) {
+        const int source_row = border_index(i - kernel_radius, height, border);
+        if (source_row < 0) {
+            return;
+        }
+        const T* row = image.getSamples<T>(source_row);
+        for (int p = 0; p < planes; p++) {
+            float* plane_row = &source[p * source_size + static_cast<size_t>(i) * source_stride];
+            for (int j = 0; j < source_stride; j++) {
+                if (columns[j] < 0) {
+                    continue;
+                }
+                const T* pixel = row + columns[j] * bpp;
+                plane_row[j] = p < colors && premultiplied
+                    ? static_cast<float>(pixel[p] * (pixel[bpp - 1] / full))
+                    : static_cast<float>(pixel[p]);
+            }
+        }
+    });
+    for (int p = 0; p < planes; p++) {
+        convolve_float(&source[p * source_size + static_cast<size_t>(kernel_radius) * source_stride + kernel_radius],
+                       source_stride, &dest[p * dest_size], width, width, height, analysis);
+    }
+    auto* new_image = new ImageMatrix(width, height, bpp, 0, image.getSampleType());
+    parallel_for(height, [&](const int& i) {
+        const T* row = image.getSamples<T>(i);
+        T* new_row = new_image->getSamples<T>(i);
+        const float* alpha = &dest[(planes - 1) * dest_size + static_cast<size_t>(i) * width];
+        for (int p = 0; p < planes; p++) {
+            const float* plane_row = &dest[p * dest_size + static_cast<size_t>(i) * width];
+            for (int j = 0; j < width; j++) {
+                double value = plane_row[j];
+                if (p < colors && premultiplied) {
+                    value = alpha[j] > 0.0f ? value / alpha[j] * full : 0.0;
+                }
+                new_row[j * bpp + p] = to_sample<T>(value);
+            }
+        }
+        // Alpha that was not convolved is kept as it is
+        if (planes < bpp) {
+            for (int j = planes; j < bpp * width; j += bpp) {
+                new_row[j] = row[j];
+            }
+        }
+    });
+    return new_image;
+}
+
+
+/**
+ * Fills the border around a block of pixels. Only the border is visited, so the
+ * index mapping of the border mode never runs for pixels inside the image.
+ * @param origin The top left pixel
+ * @param stride Bytes between the starts of two rows
+ * @param width The width of the block
+ * @param height The height of the block
+ * @param bpp Bytes per pixel
+ * @param padding Width of the border in pixels
+ * @param mode The border mode
+*/
+void fill_border_pixels(uint8_t* origin, const int& stride, const int& width, const int& height,
+                        const int& bpp, const int& padding, const BorderMode& mode) {
+    if (padding == 0) {
+        return;
+    }
+    // Copies a pixel from inside the block, or zeroes it
+    auto fill_pixel = [&](uint8_t* row, const int& column) {
+        const int source = border_index(column, width, mode);
+        if (source < 0) {
+            memset(row + column * bpp, 0, bpp);
+        }
+        else {
+            memcpy(row + column * bpp, row + source * bpp, bpp);
+        }
+    };
+    // Copies a whole padded row, corners included, or zeroes it
+    const size_t row_bytes = static_cast<size_t>(width + 2 * padding) * bpp;
+    auto fill_row = [&](const int& row) {
+        uint8_t* dest = origin + static_cast<ptrdiff_t>(row) * stride - padding * bpp;
+        const int source = border_index(row, height, mode);
+        if (source < 0) {
+            memset(dest, 0, row_bytes);
+        }
+        else {
+            memcpy(dest, origin + static_cast<ptrdiff_t>(source) * stride - padding * bpp, row_bytes);
+        }
+    };
+    // Left and right strips next to the rows of the block
+    for (int i = 0; i < height; i++) {
+        uint8_t* row = origin + static_cast<ptrdiff_t>(i) * stride;
+        for (int j = 1; j <= padding; j++) {
+            fill_pixel(row, -j);
+            fill_pixel(row, width - 1 + j);
+        }
+    }
+    // Rows above and below the block
+    for (int i = 1; i <= padding; i++) {
+        fill_row(-i);
+        fill_row(height - 1 + i);
+    }
+}
 
 
 PixelVector::PixelVector(const uint8_t r, const uint8_t g, const uint8_t b) {
@@ -24,66 +276,267 @@ PixelVector::PixelVector(const uint8_t r, const uint8_t g, const uint8_t b) {
 }
 
 
-ImageMatrix::ImageMatrix(const int& width, const int& height, const int& bpp) {
-    this->image_data = new uint8_t[width * height * bpp]{};
+ImageMatrix::ImageMatrix(const int& width, const int& height, const int& bpp)
+    : ImageMatrix(width, height, bpp, 0) {
+}
+
+
+ImageMatrix::ImageMatrix(const int& width, const int& height, const int& bpp, const int& padding)
+    : ImageMatrix(width, height, bpp, padding, SampleType::U8) {
+}
+
+
+ImageMatrix::ImageMatrix(const int& width, const int& height, const int& bpp, const int& padding,
+                         const SampleType& sample_type) {
     this->width = width;
     this->height = height;
     this->bpp = bpp;
+    this->sample_type = sample_type;
+    this->padding = padding;
+    // Pad the left border up to an aligned boundary so every row of the image itself is aligned
+    const size_t pixel_bytes = getPixelBytes();
+    const size_t left = align_up(padding * pixel_bytes);
+    this->stride = static_cast<int>(align_up(left + (width + padding) * pixel_bytes));
+    this->allocation = shared_ptr<uint8_t>(allocate_aligned(static_cast<size_t>(stride) * (height + 2 * padding)),
+                                           free_aligned);
+    this->image_data = allocation.get() + static_cast<size_t>(padding) * stride + left;
+    this->parent = nullptr;
+    this->parent_offset = 0;
 }
 
 
-ImageMatrix::ImageMatrix(std::uint8_t* image_data, const int& width, const int& height, const int& bpp) {
-    this->image_data = image_data;
+ImageMatrix::ImageMatrix(const ImageMatrix& image)
+    : allocation(image.allocation), image_data(image.image_data), parent(nullptr), parent_offset(0),
+      width(image.width), height(image.height), bpp(image.bpp), sample_type(image.sample_type),
+      stride(image.stride), padding(image.padding) {
+    // A view does not own its samples, so its copy gets samples of its own right away
+    if (image.parent != nullptr) {
+        stride = static_cast<int>(align_up(static_cast<size_t>(width) * getPixelBytes()));
+        copy_samples(image);
+    }
+}
+
+
+void ImageMatrix::copy_samples(const ImageMatrix& image) {
+    // Copy the border along with the image
+    const int pixel_bytes = getPixelBytes();
+    const size_t left = align_up(padding * pixel_bytes);
+    shared_ptr<uint8_t> block(allocate_aligned(static_cast<size_t>(stride) * (height + 2 * padding)), free_aligned);
+    uint8_t* data = block.get() + static_cast<size_t>(padding) * stride + left;
+    const int row_bytes = (width + 2 * padding) * pixel_bytes;
+    for (int i = -padding; i < height + padding; i++) {
+        memcpy(data + static_cast<ptrdiff_t>(i) * stride - padding * pixel_bytes,
+               image.getRow(i) - padding * pixel_bytes, row_bytes);
+    }
+    allocation = block;
+    image_data = data;
+}
+
+
+void ImageMatrix::detach() {
+    if (parent != nullptr) {
+        parent->detach();
+    }
+    else if (allocation.use_count() > 1) {
+        copy_samples(*this);
+    }
+}
+
+
+ImageMatrix::ImageMatrix(ImageMatrix& parent, const ptrdiff_t& offset, const int& width, const int& height) {
     this->width = width;
     this->height = height;
-    this->bpp = bpp;
+    this->bpp = parent.bpp;
+    this->sample_type = parent.sample_type;
+    this->padding = 0;
+    this->stride = parent.stride;
+    this->image_data = nullptr;
+    this->parent = &parent;
+    this->parent_offset = offset;
 }
 
 
-ImageMatrix::ImageMatrix(const ImageMatrix& image) {
-    ImageMatrix(width, height, bpp);
-    for (int i = 0; i < getHeight(); i++) {
-        for (int j = 0; j < getWidth(); j++) {
-            PixelVector pixel_data = image.get(i, j);
-            set(i, j, pixel_data);
-        }
-    }
+ImageView::ImageView(ImageMatrix& parent, const int& x, const int& y, const int& width, const int& height)
+    : ImageMatrix(parent, static_cast<ptrdiff_t>(y) * parent.getStride() + static_cast<ptrdiff_t>(x) * parent.getPixelBytes(),
+                  width, height) {
 }
 
 
 ImageMatrix::~ImageMatrix() {
-    delete[] image_data;
+    allocation.reset();
     image_data = nullptr;
 }
 
 
+void ImageMatrix::fill_border(const BorderMode& mode) {
+    fill_border_pixels(getImageData(), stride, width, height, getPixelBytes(), padding, mode);
+}
+
+
+void ImageMatrix::copy_from(const ImageMatrix& image) {
+    const size_t row_bytes = static_cast<size_t>(width) * getPixelBytes();
+    for (int i = 0; i < height; i++) {
+        memcpy(getRow(i), image.getRow(i), row_bytes);
+    }
+}
+
+
+ImageMatrix* ImageMatrix::padded(const int& padding) const {
+    auto* new_image = new ImageMatrix(width, height, bpp, padding, sample_type);
+    for (int i = 0; i < height; i++) {
+        memcpy(new_image->getRow(i), getRow(i), static_cast<size_t>(width) * getPixelBytes());
+    }
+    return new_image;
+}
+
+
+/**
+ * Converts every sample of an image to another sample type
+ * @param image The image
+ * @param new_image The output image, of the same size and number of channels
+*/
+template <typename From, typename To>
+void convert_samples(const ImageMatrix& image, ImageMatrix& new_image) {
+    const double scale = sample_max(new_image.getSampleType()) / sample_max(image.getSampleType());
+    parallel_for(image.getHeight(), [&](const int& i) {
+        const From* row = image.getSamples<From>(i);
+        To* new_row = new_image.getSamples<To>(i);
+        for (int j = 0; j < image.getWidth() * image.getBpp(); j++) {
+            new_row[j] = to_sample<To>(row[j] * scale);
+        }
+    });
+}
+
+
+/**
+ * Converts every sample of an image to the sample type of the output image
+ * @param image The image
+ * @param new_image The output image, of the same size and number of channels
+*/
+template <typename From>
+void convert_samples(const ImageMatrix& image, ImageMatrix& new_image) {
+    switch (new_image.getSampleType()) {
+        case SampleType::U8:
+            convert_samples<From, uint8_t>(image, new_image);
+            break;
+        case SampleType::U16:
+            convert_samples<From, uint16_t>(image, new_image);
+            break;
+        case SampleType::F32:
+            convert_samples<From, float>(image, new_image);
+            break;
+    }
+}
+
+
+ImageMatrix* ImageMatrix::converted(const SampleType& sample_type) const {
+    if (sample_type == this->sample_type) {
+        return new ImageMatrix(*this);
+    }
+    auto* new_image = new ImageMatrix(width, height, bpp, 0, sample_type);
+    switch (this->sample_type) {
+        case SampleType::U8:
+            convert_samples<uint8_t>(*this, *new_image);
+            break;
+        case SampleType::U16:
+            convert_samples<uint16_t>(*this, *new_image);
+            break;
+        case SampleType::F32:
+            convert_samples<float>(*this, *new_image);
+            break;
+    }
+    return new_image;
+}
+
+
 PixelVector ImageMatrix::get(const int& row, const int& column) const {
     // Index of pixel in original image
-    const int index = bpp * (column + row * width);
+    const ptrdiff_t index = static_cast<ptrdiff_t>(row) * stride + bpp * column;
+    const uint8_t* data = getImageData();
     // RGB values of pixel
-    const uint8_t r = image_data[index];
-    const uint8_t g = image_data[index + 1];
-    const uint8_t b = image_data[index + 2];
+    const uint8_t r = data[index];
+    const uint8_t g = data[index + 1];
+    const uint8_t b = data[index + 2];
     // Create and return Pixel object
     return {r, g, b};
 }
 
 
-void ImageMatrix::set(const int& row, const int& column, const PixelVector& pixel_data) const {
+void ImageMatrix::set(const int& row, const int& column, const PixelVector& pixel_data) {
     // Index of pixel in original image
-    const int index = bpp * (column + row * width);
+    const ptrdiff_t index = static_cast<ptrdiff_t>(row) * stride + bpp * column;
+    uint8_t* data = getImageData();
     // Set the byte values
-    image_data[index] = pixel_data.r;
-    image_data[index + 1] = pixel_data.g;
-    image_data[index + 2] = pixel_data.b;
+    data[index] = pixel_data.r;
+    data[index + 1] = pixel_data.g;
+    data[index + 2] = pixel_data.b;
 }
 
 
-ImageMatrix* ImageMatrix::filter(const double* matrix) const {
-    auto* new_image = new ImageMatrix(width, height, bpp);
-    for (int i = 0; i < getHeight(); i++) {
-        for (int j = 0; j < getWidth(); j++) {
-            PixelVector pixel_data = get(i, j);
+/**
+ * Performs a single operation on every pixel of an image. Each pixel is read before the
+ * same pixel of the output is written, so the output may be the image itself.
+ * @param image The image
+ * @param new_image The output image, with three more channels than a gray image if the
+ * matrix does not keep gray and as many channels otherwise
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+*/
+void filter_pixels(const ImageMatrix& image, ImageMatrix& new_image, const double* matrix) {
+    const int width = image.getWidth();
+    const int height = image.getHeight();
+    const int bpp = image.getBpp();
+    if (image.getSampleType() != SampleType::U8) {
+        if (image.getSampleType() == SampleType::U16) {
+            filter_samples<uint16_t>(image, new_image, matrix);
+        }
+        else {
+            filter_samples<float>(image, new_image, matrix);
+        }
+        return;
+    }
+    if (bpp < 3) {
+        // The image stays gray if the matrix maps gray to gray, and becomes RGB otherwise;
+        // alpha is kept either way
+        uint8_t tables[3][256];
+        gray_tables(matrix, tables);
+        const int new_bpp = new_image.getBpp();
+        for (int i = 0; i < height; i++) {
+            const uint8_t* row = image.getRow(i);
+            uint8_t* new_row = new_image.getRow(i);
+            for (int j = 0; j < width; j++) {
+                const uint8_t value = row[j * bpp];
+                for (int c = 0; c < new_bpp - bpp + 1; c++) {
+                    new_row[j * new_bpp + c] = tables[c][value];
+                }
+                if (bpp == 2) {
+                    new_row[j * new_bpp + new_bpp - 1] = row[j * bpp + 1];
+                }
+            }
+        }
+        return;
+    }
+    // A point operation reads every pixel once, so it stays interleaved; splitting
+    // into planes first would cost more than the vectorized planar loop saves.
+    // Per-channel operations such as invert and contrast become one lookup per channel
+    uint8_t tables[3][256];
+    if (bpp >= 3 && channel_tables(matrix, tables)) {
+        for (int i = 0; i < height; i++) {
+            const uint8_t* row = image.getRow(i);
+            uint8_t* new_row = new_image.getRow(i);
+            for (int j = 0; j < width * bpp; j += bpp) {
+                new_row[j] = tables[0][row[j]];
+                new_row[j + 1] = tables[1][row[j + 1]];
+                new_row[j + 2] = tables[2][row[j + 2]];
+                if (bpp == 4) {
+                    new_row[j + 3] = row[j + 3];
+                }
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            PixelVector pixel_data = image.get(i, j);
             const double r = pixel_data.r;
             const double g = pixel_data.g;
             const double b = pixel_data.b;
@@ -93,22 +546,73 @@ ImageMatrix* ImageMatrix::filter(const double* matrix) const {
             pixel_data.r = static_cast<uint8_t>(round(min(255.0, max(0.0, new_r))));
             pixel_data.g = static_cast<uint8_t>(round(min(255.0, max(0.0, new_g))));
             pixel_data.b = static_cast<uint8_t>(round(min(255.0, max(0.0, new_b))));
-            new_image->set(i, j, pixel_data);
+            new_image.set(i, j, pixel_data);
+            if (bpp == 4) {
+                new_image.getRow(i)[j * 4 + 3] = image.getRow(i)[j * 4 + 3];
+            }
         }
     }
+}
+
+
+ImageMatrix* ImageMatrix::filter(const double* matrix) const {
+    const int new_bpp = bpp < 3 && !filter_keeps_gray(matrix, sample_type) ? bpp + 2 : bpp;
+    auto* new_image = new ImageMatrix(width, height, new_bpp, 0, sample_type);
+    filter_pixels(*this, *new_image, matrix);
     return new_image;
 }
 
 
+bool ImageMatrix::filter_in_place(const double* matrix) {
+    // Filtering a shared image into a new one saves copying it first
+    if (isShared() || (bpp < 3 && !filter_keeps_gray(matrix, sample_type))) {
+        return false;
+    }
+    filter_pixels(*this, *this, matrix);
+    return true;
+}
+
+
 ImageMatrix* ImageMatrix::convolve(const double* kernel, const size_t& kernel_size) const {
     return convolve(kernel, kernel_size, 1.0);
 }
 
 
 ImageMatrix* ImageMatrix::convolve(const double* kernel, const size_t& kernel_size, const double& scalar) const {
+    return convolve(kernel, kernel_size, scalar, BorderMode::ZERO);
+}
+
+
+ImageMatrix* ImageMatrix::convolve(const double* kernel, const size_t& kernel_size, const double& scalar,
+                                   const BorderMode& border) const {
+    if (sample_type == SampleType::U16) {
+        return convolve_samples<uint16_t>(*this, kernel, kernel_size, scalar, border);
+    }
+    if (sample_type == SampleType::F32) {
+        return convolve_samples<float>(*this, kernel, kernel_size, scalar, border);
+    }
+    if (convolves_float_planes(bpp, sample_type, kernel, kernel_size, scalar)) {
+        return convolve_samples<uint8_t>(*this, kernel, kernel_size, scalar, border);
+    }
     auto* new_image = new ImageMatrix(width, height, bpp);
     const int kernel_rows = static_cast<int>(sqrt(kernel_size));
     const int kernel_radius = kernel_rows / 2;
+    // Every tap re-reads the whole image, so splitting it into planes once pays off
+    // unless the kernel is a single tap or the image is tiny. Gray images always use
+    // planes, since the interleaved loop below reads RGB pixels.
+    if ((kernel_size > 1 && width * height >= PLANAR_MIN_PIXELS) || bpp < 3) {
+        const PlanarImage planar(*this, color_channels(bpp), kernel_radius);
+        const PlanarImage* convolved = planar.convolve(kernel, kernel_size, scalar, border);
+        convolved->interleave(*new_image);
+        delete convolved;
+        if (has_alpha(bpp)) {
+            copy_alpha(*this, *new_image);
+        }
+        return new_image;
+    }
+    // Taps outside the image read the border of a padded copy
+    ImageMatrix* source = padded(kernel_radius);
+    source->fill_border(border);
     // Iterate through image matrix
     for (int i = 0; i < getHeight(); i++) {
         for (int j = 0; j < getWidth(); j++) {
@@ -118,12 +622,8 @@ ImageMatrix* ImageMatrix::convolve(const double* kernel, const size_t& kernel_si
             double b_total = 0.0;
             for (int k = -kernel_radius; k <= kernel_radius; k++) {
                 for (int l = -kernel_radius; l <= kernel_radius; l++) {
-                    // Skip pixel if out of range
-                    if (i - k < 0 || i - k >= height || j - l < 0 || j - l >= width) {
-                        continue;
-                    }
                     const double kernel_entry = kernel[(k + kernel_radius) * kernel_rows + (l + kernel_radius)];
-                    const PixelVector pixel_data = get(i - k, j - l);
+                    const PixelVector pixel_data = source->get(i - k, j - l);
                     r_total += pixel_data.r * kernel_entry * scalar;
                     g_total += pixel_data.g * kernel_entry * scalar;
                     b_total += pixel_data.b * kernel_entry * scalar;
@@ -135,10 +635,210 @@ ImageMatrix* ImageMatrix::convolve(const double* kernel, const size_t& kernel_si
             new_image->set(i, j, PixelVector(r, g, b));
         }
     }
+    delete source;
+    if (has_alpha(bpp)) {
+        copy_alpha(*this, *new_image);
+    }
     return new_image;
 }
 
 
+PlanarImage::PlanarImage(const int& width, const int& height, const int& channels, const int& padding) {
+    this->width = width;
+    this->height = height;
+    this->channels = channels;
+    this->padding = padding;
+    // Pad the left border up to an aligned boundary so every row of the image itself is aligned
+    const size_t left = align_up(padding);
+    this->stride = static_cast<int>(align_up(left + width + padding));
+    this->plane_size = static_cast<size_t>(stride) * (height + 2 * padding);
+    this->origin = static_cast<size_t>(padding) * stride + left;
+    this->plane_data = allocate_aligned(plane_size * channels);
+}
+
+
+PlanarImage::PlanarImage(const ImageMatrix& image, const int& channels, const int& padding)
+    : PlanarImage(image.getWidth(), image.getHeight(), channels, padding) {
+    const int bpp = image.getBpp();
+    for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < height; i++) {
+            const uint8_t* image_row = image.getRow(i);
+            uint8_t* row = getRow(c, i);
+            for (int j = 0; j < width; j++) {
+                row[j] = image_row[j * bpp + c];
+            }
+        }
+    }
+}
+
+
+PlanarImage::~PlanarImage() {
+    free_aligned(plane_data);
+    plane_data = nullptr;
+}
+
+
+void PlanarImage::interleave(ImageMatrix& image) const {
+    const int bpp = image.getBpp();
+    for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < height; i++) {
+            const uint8_t* row = getRow(c, i);
+            uint8_t* image_row = image.getRow(i);
+            for (int j = 0; j < width; j++) {
+                image_row[j * bpp + c] = row[j];
+            }
+        }
+    }
+}
+
+
+PlanarImage* PlanarImage::filter(const double* matrix) const {
+    auto* new_image = new PlanarImage(width, height, 3, 0);
+    uint8_t tables[3][256];
+    if (channel_tables(matrix, tables)) {
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < height; i++) {
+                const uint8_t* row = getRow(c, i);
+                uint8_t* new_row = new_image->getRow(c, i);
+                for (int j = 0; j < width; j++) {
+                    new_row[j] = tables[c][row[j]];
+                }
+            }
+        }
+        return new_image;
+    }
+    for (int i = 0; i < height; i++) {
+        const uint8_t* r_row = getRow(0, i);
+        const uint8_t* g_row = getRow(1, i);
+        const uint8_t* b_row = getRow(2, i);
+        uint8_t* new_r_row = new_image->getRow(0, i);
+        uint8_t* new_g_row = new_image->getRow(1, i);
+        uint8_t* new_b_row = new_image->getRow(2, i);
+        for (int j = 0; j < width; j++) {
+            const double r = r_row[j];
+            const double g = g_row[j];
+            const double b = b_row[j];
+            new_r_row[j] = clamp_round(matrix[0]*r + matrix[1]*g + matrix[2]*b + matrix[3]);
+            new_g_row[j] = clamp_round(matrix[4]*r + matrix[5]*g + matrix[6]*b + matrix[7]);
+            new_b_row[j] = clamp_round(matrix[8]*r + matrix[9]*g + matrix[10]*b + matrix[11]);
+        }
+    }
+    return new_image;
+}
+
+
+void PlanarImage::fill_border(const BorderMode& mode) const {
+    for (int c = 0; c < channels; c++) {
+        fill_border_pixels(getPlane(c), stride, width, height, 1, padding, mode);
+    }
+}
+
+
+PlanarImage* PlanarImage::convolve(const double* kernel, const size_t& kernel_size, const double& scalar,
+                                   const BorderMode& border) const {
+    const int kernel_rows = static_cast<int>(sqrt(kernel_size));
+    const int kernel_radius = kernel_rows / 2;
+    // Taps outside the image read the border, so it has to cover the kernel radius
+    if (padding < kernel_radius) {
+        PlanarImage source(width, height, channels, kernel_radius);
+        for (int c = 0; c < channels; c++) {
+            for (int i = 0; i < height; i++) {
+                memcpy(source.getRow(c, i), getRow(c, i), width);
+            }
+        }
+        return source.convolve(kernel, kernel_size, scalar, border);
+    }
+    fill_border(border);
+    auto* new_image = new PlanarImage(width, height, channels, 0);
+    // The analysis picks the cheapest backend for the kernel; 8-bit planes are convolved in
+    // fixed point whenever that is exact, or when rounding the weights moves no output by more
+    // than 1/64 of a level, which can still flip an output that lies next to a rounding boundary
+    convolve_planes(*this, *new_image, analyze_kernel(kernel, kernel_size, scalar));
+    return new_image;
+}
+
+
+int border_index(const int& index, const int& size, const BorderMode& mode) {
+    if (index >= 0 && index < size) {
+        return index;
+    }
+    switch (mode) {
+        case BorderMode::CLAMP:
+            return index < 0 ? 0 : size - 1;
+        case BorderMode::REFLECT: {
+            if (size == 1) {
+                return 0;
+            }
+            // Reflections repeat every two passes over the image
+            const int period = 2 * (size - 1);
+            int reflected = index % period;
+            if (reflected < 0) {
+                reflected += period;
+            }
+            return reflected < size ? reflected : period - reflected;
+        }
+        case BorderMode::WRAP: {
+            const int wrapped = index % size;
+            return wrapped < 0 ? wrapped + size : wrapped;
+        }
+        default:
+            return -1;
+    }
+}
+
+
+bool filter_keeps_gray(const double* matrix, const SampleType& sample_type) {
+    if (sample_type == SampleType::U8) {
+        uint8_t tables[3][256];
+        gray_tables(matrix, tables);
+        return memcmp(tables[0], tables[1], 256) == 0 && memcmp(tables[0], tables[2], 256) == 0;
+    }
+    // Wider samples have too many values for tables, so every row needs the same sum and offset
+    const double sum = matrix[0] + matrix[1] + matrix[2];
+    return sum == matrix[4] + matrix[5] + matrix[6] && sum == matrix[8] + matrix[9] + matrix[10]
+        && matrix[3] == matrix[7] && matrix[3] == matrix[11];
+}
+
+
+bool convolves_float_planes(const int& bpp, const SampleType& sample_type, const double* kernel,
+                            const size_t& kernel_size, const double& scalar) {
+    return sample_type != SampleType::U8 || (has_alpha(bpp) && averaging_kernel(kernel, kernel_size, scalar));
+}
+
+
+void copy_alpha(const ImageMatrix& source, ImageMatrix& dest) {
+    const int pixel_bytes = source.getPixelBytes();
+    const int alpha_bytes = sample_size(source.getSampleType());
+    for (int i = 0; i < source.getHeight(); i++) {
+        const uint8_t* row = source.getRow(i);
+        uint8_t* new_row = dest.getRow(i);
+        for (int j = pixel_bytes - alpha_bytes; j < source.getWidth() * pixel_bytes; j += pixel_bytes) {
+            if (alpha_bytes == 1) {
+                new_row[j] = row[j];
+            }
+            else {
+                memcpy(new_row + j, row + j, alpha_bytes);
+            }
+        }
+    }
+}
+
+
+uint8_t* allocate_aligned(const size_t& size) {
+    // A reused block is zeroed here, which is much cheaper than faulting in fresh pages
+    uint8_t* data = shared_buffer_pool().take(size);
+    memset(data, 0, size);
+    return data;
+}
+
+
+void free_aligned(uint8_t* data) {
+    if (data != nullptr) {
+        shared_buffer_pool().give(data);
+    }
+}
+
+
 ImageMatrix* read_image(const string& ref_path, int& width, int& height, int& bpp) {
     // Assert valid reference file type
     const string ext = ref_path.substr(ref_path.find_last_of('.') + 1);
@@ -153,48 +853,170 @@ ImageMatrix* read_image(const string& ref_path, int& width, int& height, int& bp
         cout << "Invalid file type: " << ext << endl;
         exit(2);
     }
-    // Read image
-    uint8_t* image = stbi_load(ref_path.c_str(), &width, &height, &bpp, 0);
-    // Move to dynamically loaded array so it can be deleted with the delete[] keyword later
-    auto* new_image = new uint8_t[width * height * bpp];
+    // Read image, keeping the samples of 16-bit PNGs and HDR files instead of truncating them
+    SampleType sample_type = SampleType::U8;
+    void* image;
+    if (stbi_is_hdr(ref_path.c_str())) {
+        sample_type = SampleType::F32;
+        image = stbi_loadf(ref_path.c_str(), &width, &height, &bpp, 0);
+    }
+    else if (stbi_is_16_bit(ref_path.c_str())) {
+        sample_type = SampleType::U16;
+        image = stbi_load_16(ref_path.c_str(), &width, &height, &bpp, 0);
+    }
+    else {
+        image = stbi_load(ref_path.c_str(), &width, &height, &bpp, 0);
+    }
+    if (image == nullptr) {
+        cout << "Could not read image: " << ref_path << endl;
+        exit(2);
+    }
+    // Copy into an image matrix, whose rows are aligned
+    auto* new_image = new ImageMatrix(width, height, bpp, 0, sample_type);
+    const size_t row_bytes = static_cast<size_t>(width) * new_image->getPixelBytes();
     for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Index of pixel in original image
-            const int index = bpp * (j + i * width);
-            // RGB values of pixel
-            const uint8_t r = image[index];
-            const uint8_t g = image[index + 1];
-            const uint8_t b = image[index + 2];
-            const auto pixel = PixelVector(r, g, b);
-            new_image[index] = pixel.r;
-            new_image[index + 1] = pixel.g;
-            new_image[index + 2] = pixel.b;
-        }
+        memcpy(new_image->getRow(i), static_cast<uint8_t*>(image) + i * row_bytes, row_bytes);
     }
     stbi_image_free(image);
     // ... process data if not NULL ...
     // ... x = width, y = height, n = # 8-bit components per pixel ...
     // ... replace '0' with '1'..'4' to force that many components per pixel
     // ... but 'n' will always be the number that it would have been if you said 0
-    return new ImageMatrix(new_image, width, height, bpp);
+    return new_image;
+}
+
+
+void read_image_info(const string& ref_path, int& bpp, SampleType& sample_type) {
+    int width, height;
+    if (!stbi_info(ref_path.c_str(), &width, &height, &bpp)) {
+        cout << "Could not read image: " << ref_path << endl;
+        exit(2);
+    }
+    sample_type = stbi_is_hdr(ref_path.c_str()) ? SampleType::F32
+        : stbi_is_16_bit(ref_path.c_str()) ? SampleType::U16 : SampleType::U8;
+}
+
+
+/**
+ * Quantizes every sample of an image to 8 bits with an ordered dither
+ * @param image The image
+ * @param first_row The row of the dither matrix that the first row of the image starts at
+ * @param new_image The output image, of the same size and number of channels
+*/
+template <typename T>
+void dither_samples(const ImageMatrix& image, const int& first_row, ImageMatrix& new_image) {
+    // Bayer matrix: every threshold is used once per tile, in an order that spreads them out
+    double thresholds[DITHER_SIZE][DITHER_SIZE];
+    for (int y = 0; y < DITHER_SIZE; y++) {
+        for (int x = 0; x < DITHER_SIZE; x++) {
+            int rank = 0;
+            for (int bit = 1, xor_bits = x ^ y; bit < DITHER_SIZE; bit *= 2) {
+                rank = rank * 4 + ((xor_bits & bit) ? 2 : 0) + ((y & bit) ? 1 : 0);
+            }
+            thresholds[y][x] = (rank + 0.5) / (DITHER_SIZE * DITHER_SIZE) - 0.5;
+        }
+    }
+    const int bpp = image.getBpp();
+    const int colors = color_channels(bpp);
+    const double scale = 255.0 / sample_max(image.getSampleType());
+    parallel_for(image.getHeight(), [&](const int& i) {
+        const T* row = image.getSamples<T>(i);
+        uint8_t* new_row = new_image.getRow(i);
+        for (int j = 0; j < image.getWidth(); j++) {
+            const double threshold = thresholds[(first_row + i) % DITHER_SIZE][j % DITHER_SIZE];
+            for (int c = 0; c < bpp; c++) {
+                const double value = row[j * bpp + c] * scale;
+                new_row[j * bpp + c] = clamp_round(c < colors ? value + threshold : value);
+            }
+        }
+    });
+}
+
+
+ImageMatrix* dither(const ImageMatrix& image) {
+    return dither(image, 0);
+}
+
+
+ImageMatrix* dither(const ImageMatrix& image, const int& first_row) {
+    if (image.getSampleType() == SampleType::U8) {
+        return new ImageMatrix(image);
+    }
+    auto* new_image = new ImageMatrix(image.getWidth(), image.getHeight(), image.getBpp());
+    if (image.getSampleType() == SampleType::U16) {
+        dither_samples<uint16_t>(image, first_row, *new_image);
+    }
+    else {
+        dither_samples<float>(image, first_row, *new_image);
+    }
+    return new_image;
 }
 
 
 void write_image(const string& out_path, const ImageMatrix& new_image) {
+    write_image(out_path, new_image, false);
+}
+
+
+void write_image(const string& out_path, const ImageMatrix& new_image, const bool& dithered) {
     const string ext = string(out_path).substr(string(out_path).find_last_of('.') + 1);
+    if (iequals(ext, "hdr")) {
+        // Radiance files hold float samples, so any other type is converted first
+        const ImageMatrix* image = new_image.converted(SampleType::F32);
+        const int width = image->getWidth();
+        const int bpp = image->getBpp();
+        vector<float> packed(static_cast<size_t>(width) * bpp * image->getHeight());
+        for (int i = 0; i < image->getHeight(); i++) {
+            memcpy(&packed[static_cast<size_t>(i) * width * bpp], image->getRow(i), width * image->getPixelBytes());
+        }
+        stbi_write_hdr(out_path.c_str(), width, image->getHeight(), bpp, &packed[0]);
+        delete image;
+        return;
+    }
+    if (new_image.getSampleType() != SampleType::U8) {
+        // The other encoders only take 8-bit samples
+        const ImageMatrix* image = dithered ? dither(new_image) : new_image.converted(SampleType::U8);
+        write_image(out_path, *image);
+        delete image;
+        return;
+    }
     const uint8_t* image_data = new_image.getImageData();
     const int width = new_image.getWidth();
     const int height = new_image.getHeight();
     const int bpp = new_image.getBpp();
-    if (iequals(ext, "png"))
-        stbi_write_png(out_path.c_str(), width, height, bpp, image_data, width * bpp);
-    else if (iequals(ext, "bmp"))
+    // PNG takes the stride directly; the other encoders need tightly packed rows
+    if (iequals(ext, "png")) {
+        stbi_write_png(out_path.c_str(), width, height, bpp, image_data, new_image.getStride());
+        return;
+    }
+    const size_t row_bytes = static_cast<size_t>(width) * bpp;
+    vector<uint8_t> packed;
+    if (new_image.getStride() != static_cast<int>(row_bytes)) {
+        packed.resize(row_bytes * height);
+        for (int i = 0; i < height; i++) {
+            memcpy(&packed[i * row_bytes], new_image.getRow(i), row_bytes);
+        }
+        image_data = &packed[0];
+    }
+    if (iequals(ext, "bmp"))
         stbi_write_bmp(out_path.c_str(), width, height, bpp, image_data);
     else if (iequals(ext, "jpg") || iequals(ext, "jpeg"))
         stbi_write_jpg(out_path.c_str(), width, height, bpp, image_data, QUALITY);
 }
 
 
+string read_textfile(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        cout << "Could not read text file: " << path << endl;
+        exit(2);
+    }
+    ostringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+
 void write_textfile(const std::string& out_path, const std::string& text) {
     ofstream file;
     file.open(out_path);
@@ -3,6 +3,10 @@
 
 #include <string>
 #include <cstdint>
+#include <cstddef>
+#include <memory>
+
+constexpr size_t ROW_ALIGNMENT = 64; // Alignment of image rows in bytes
 
 /**
  * Represents a pixel with RGB data
@@ -24,13 +28,80 @@ public:
 
 
 /**
- * Represents a matrix which represents an image
+ * Determines which values are read for pixels outside of an image
+*/
+enum class BorderMode {
+ ZERO, // Every pixel outside of the image is zero
+ CLAMP, // Repeats the nearest edge pixel
+ REFLECT, // Mirrors the image at its edges, without repeating the edge pixel
+ WRAP // Tiles the image
+};
+
+
+/**
+ * Determines how each channel value of an image is stored
+*/
+enum class SampleType {
+ U8, // 8-bit unsigned integer, 0 - 255
+ U16, // 16-bit unsigned integer, 0 - 65535
+ F32 // 32-bit float, nominally 0 - 1 but neither clamped nor rounded
+};
+
+
+/**
+ * Returns the size of a sample in bytes
+ * @param type The sample type
+ * @return The size in bytes
+*/
+inline int sample_size(const SampleType& type) {
+ return type == SampleType::U8 ? 1 : type == SampleType::U16 ? 2 : 4;
+}
+
+
+/**
+ * Returns the sample value of full intensity
+ * @param type The sample type
+ * @return 255 for 8-bit, 65535 for 16-bit and 1 for float samples
+*/
+inline double sample_max(const SampleType& type) {
+ return type == SampleType::U8 ? 255.0 : type == SampleType::U16 ? 65535.0 : 1.0;
+}
+
+
+/**
+ * Represents a matrix which represents an image. Rows start on ROW_ALIGNMENT byte
+ * boundaries, so the stride between two rows may be larger than width * bpp, and
+ * the image may be surrounded by a border of padding pixels that can be read past
+ * the edges of the image. Samples are 8-bit unless another sample type is given;
+ * getRow always returns the bytes of a row, and getSamples the typed samples.
+ * Copies share their samples until one of them writes. The accessors of a const image
+ * only read; the accessors of a non-const one hand out writable samples, so they copy
+ * shared samples first.
 */
 class ImageMatrix {
- std::uint8_t* image_data; // Image data
+ std::shared_ptr<std::uint8_t> allocation; // The allocated block, including the border, or empty for a view
+ std::uint8_t* image_data; // Image data, starting at the top left pixel, or unused for a view
+ ImageMatrix* parent; // The image a view shows part of, or nullptr for an image with samples of its own
+ std::ptrdiff_t parent_offset; // Bytes from the top left pixel of the parent to that of a view
  int width; // The width of the image
  int height; // The height of the image
- int bpp; // bytes per pixel
+ int bpp; // Channels per pixel, which is bytes per pixel for 8-bit samples
+ SampleType sample_type; // How each channel value is stored
+ int stride; // Bytes between the starts of two rows
+ int padding; // Width of the border around the image in pixels
+
+ /**
+  * Replaces the samples with a copy of those of an image of the same size and format
+  * @param image The image to copy, which may be this one
+  */
+ void copy_samples(const ImageMatrix& image);
+
+ /**
+  * Returns the top left pixel, which a view finds in its parent, since the parent moves
+  * to samples of its own when it writes while shared
+  * @return The top left pixel
+  */
+ std::uint8_t* samples() const { return parent == nullptr ? image_data : parent->samples() + parent_offset; }
 
 public:
  /**
@@ -42,29 +113,80 @@ public:
  ImageMatrix(const int& width, const int& height, const int& bpp);
 
  /**
-  * Creates a defined image
-  * @param image_data Bit data of the image
+  * Creates an empty image surrounded by a zeroed border
   * @param width The width of the image
   * @param height The height of the image
   * @param bpp Bytes per pixel
+  * @param padding Width of the border around the image in pixels
+  */
+ ImageMatrix(const int& width, const int& height, const int& bpp, const int& padding);
+
+ /**
+  * Creates an empty image of any sample type surrounded by a zeroed border
+  * @param width The width of the image
+  * @param height The height of the image
+  * @param bpp Channels per pixel
+  * @param padding Width of the border around the image in pixels
+  * @param sample_type How each channel value is stored
   */
- ImageMatrix(std::uint8_t* image_data, const int& width, const int& height, const int& bpp);
+ ImageMatrix(const int& width, const int& height, const int& bpp, const int& padding,
+  const SampleType& sample_type);
 
  /**
-  * Makes a copy from another image matrix
+  * Makes a copy from another image matrix, which shares its samples until either writes.
+  * The copy of a view gets samples of its own.
   * @param image The object to copy
   */
  ImageMatrix(const ImageMatrix& image);
 
+ ImageMatrix& operator=(const ImageMatrix& image) = delete;
+
  /**
   * Deletes the image
   */
  virtual ~ImageMatrix();
 
- std::uint8_t* getImageData() const { return image_data; }
+ const std::uint8_t* getImageData() const { return samples(); }
+ std::uint8_t* getImageData() { detach(); return samples(); }
+ const std::uint8_t* getRow(const int& row) const { return samples() + static_cast<std::ptrdiff_t>(row) * stride; }
+ std::uint8_t* getRow(const int& row) { detach(); return samples() + static_cast<std::ptrdiff_t>(row) * stride; }
  int getWidth() const { return width; }
  int getHeight() const { return height; }
  int getBpp() const { return bpp; }
+ SampleType getSampleType() const { return sample_type; }
+ int getPixelBytes() const { return bpp * sample_size(sample_type); }
+ int getStride() const { return stride; }
+ int getPadding() const { return padding; }
+ bool isShared() const { return parent != nullptr ? parent->isShared() : allocation.use_count() > 1; }
+ template <typename T> const T* getSamples(const int& row) const { return reinterpret_cast<const T*>(getRow(row)); }
+ template <typename T> T* getSamples(const int& row) { return reinterpret_cast<T*>(getRow(row)); }
+
+ /**
+  * Gives the image samples of its own if it shares them with a copy, so it can be written
+  * without changing the copy. A view detaches its parent instead.
+  */
+ void detach();
+
+ /**
+  * Makes a copy of the image with its samples converted to another type. Full intensity
+  * maps to full intensity; integer samples are rounded and clamped to their range.
+  * @param sample_type The sample type of the copy
+  * @return The converted copy
+  */
+ ImageMatrix* converted(const SampleType& sample_type) const;
+
+ /**
+  * Makes a copy of the image surrounded by a zeroed border
+  * @param padding Width of the border around the image in pixels
+  * @return The padded copy
+  */
+ ImageMatrix* padded(const int& padding) const;
+
+ /**
+  * Overwrites the border around the image with values determined by the border mode
+  * @param mode The border mode
+  */
+ void fill_border(const BorderMode& mode);
 
  /**
   * Returns the pixel data of the given entry in the image matrix
@@ -80,15 +202,24 @@ public:
   * @param column The column of the entry
   * @param pixel_data The pixel data (byte data)
   */
- void set(const int& row, const int& column, const PixelVector& pixel_data) const;
+ void set(const int& row, const int& column, const PixelVector& pixel_data);
 
  /**
- * Performs a single operation on every pixel in an image
+ * Performs a single operation on every pixel in an image. Alpha is kept as it is.
  * @param matrix Multiplies the rgb components by the first three rows and adds the last row
  * @return The output image
 */
  ImageMatrix* filter(const double* matrix) const;
 
+ /**
+ * Performs a single operation on every pixel in an image, overwriting its pixels instead
+ * of allocating a new image. Alpha is kept as it is.
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+ * @return Whether the image was filtered; a gray image that the matrix would turn RGB
+ * needs more channels, so it is left as it is
+*/
+ bool filter_in_place(const double* matrix);
+
  /**
  * Adds each element of the image to its local neighbors, weighted by the kernel
  * @param kernel The kernel matrix
@@ -105,28 +236,335 @@ public:
  * @return The output image
 */
  ImageMatrix* convolve(const double* kernel, const size_t& kernel_size, const double& scalar) const;
+
+ /**
+ * Adds each element of the image to its local neighbors, weighted by the kernel. With
+ * a kernel that averages its taps, images with alpha are blurred in premultiplied alpha,
+ * so transparent pixels do not bleed their color; other kernels keep alpha as it is.
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @param border Determines the values of neighbors outside of the image
+ * @return The output image
+*/
+ ImageMatrix* convolve(const double* kernel, const size_t& kernel_size, const double& scalar,
+  const BorderMode& border) const;
+
+ /**
+  * Overwrites every pixel with the pixel at the same position of another image
+  * @param image An image of the same size, channels and sample type
+  */
+ void copy_from(const ImageMatrix& image);
+
+protected:
+ /**
+  * Wraps pixels that belong to another image, without a border; the pixels are not
+  * copied and not deleted with this image
+  * @param parent The image the pixels belong to
+  * @param offset Bytes from the top left pixel of the parent to that of this image
+  * @param width The width of the image
+  * @param height The height of the image
+  */
+ ImageMatrix(ImageMatrix& parent, const std::ptrdiff_t& offset, const int& width, const int& height);
 };
 
 
+/**
+ * A rectangle of another image that shares its pixels instead of copying them. A view is
+ * an image matrix, so every function takes one, and writing to it writes to the parent,
+ * after giving the parent samples of its own if it shares them with a copy.
+ * Views have no border; functions that read past the edges pad a copy as they do for any
+ * image without one.
+*/
+class ImageView : public ImageMatrix {
+public:
+ /**
+  * Creates a view of a rectangle that lies inside an image
+  * @param parent The image, which must outlive the view
+  * @param x The left column of the rectangle
+  * @param y The top row of the rectangle
+  * @param width The width of the rectangle
+  * @param height The height of the rectangle
+  */
+ ImageView(ImageMatrix& parent, const int& x, const int& y, const int& width, const int& height);
+
+ ImageView(const ImageView& view) = delete;
+};
+
+
+/**
+ * Represents an image stored as one contiguous plane per channel. Each row of a plane
+ * starts on a ROW_ALIGNMENT byte boundary so per-channel loops vectorize at full width,
+ * and each plane may be surrounded by a border of padding pixels.
+*/
+class PlanarImage {
+ std::uint8_t* plane_data; // All planes, one after another
+ int width; // The width of the image
+ int height; // The height of the image
+ int channels; // The number of planes
+ int stride; // Bytes between the starts of two rows of a plane
+ int padding; // Width of the border around each plane in pixels
+ size_t plane_size; // Distance in bytes between the starts of two planes
+ size_t origin; // Offset of the top left pixel from the start of a plane
+
+public:
+ /**
+  * Creates an empty planar image surrounded by a zeroed border
+  * @param width The width of the image
+  * @param height The height of the image
+  * @param channels The number of planes
+  * @param padding Width of the border around each plane in pixels
+  */
+ PlanarImage(const int& width, const int& height, const int& channels, const int& padding);
+
+ /**
+  * Splits the leading channels of an interleaved image into planes
+  * @param image The interleaved image
+  * @param channels The number of leading channels to copy
+  * @param padding Width of the zeroed border around each plane in pixels
+  */
+ PlanarImage(const ImageMatrix& image, const int& channels, const int& padding);
+
+ PlanarImage(const PlanarImage& image) = delete;
+ PlanarImage& operator=(const PlanarImage& image) = delete;
+
+ /**
+  * Deletes the image
+  */
+ ~PlanarImage();
+
+ std::uint8_t* getPlane(const int& channel) const { return plane_data + channel * plane_size + origin; }
+ std::uint8_t* getRow(const int& channel, const int& row) const {
+  return getPlane(channel) + static_cast<std::ptrdiff_t>(row) * stride;
+ }
+ int getWidth() const { return width; }
+ int getHeight() const { return height; }
+ int getChannels() const { return channels; }
+ int getStride() const { return stride; }
+ int getPadding() const { return padding; }
+
+ /**
+  * Writes the planes into the leading channels of an interleaved image of the same size
+  * @param image The interleaved image
+  */
+ void interleave(ImageMatrix& image) const;
+
+ /**
+  * Performs a single operation on every pixel in a three-plane image
+  * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+  * @return The output image
+ */
+ PlanarImage* filter(const double* matrix) const;
+
+ /**
+  * Overwrites the border around each plane with values determined by the border mode
+  * @param mode The border mode
+  */
+ void fill_border(const BorderMode& mode) const;
+
+ /**
+  * Adds each element of every plane to its local neighbors, weighted by the kernel.
+  * Taps outside the image read the border, which is filled according to the border
+  * mode first. If the padding is narrower than the kernel radius, a padded copy is made.
+  * @param kernel The kernel matrix
+  * @param kernel_size The length of the kernel array
+  * @param scalar A scalar by which to multiply the kernel
+  * @param border Determines the values of neighbors outside of the image
+  * @return The output image
+ */
+ PlanarImage* convolve(const double* kernel, const size_t& kernel_size, const double& scalar,
+  const BorderMode& border) const;
+};
+
+
+/**
+ * Maps a row or column index outside of an image to the index it reads from
+ * @param index The index, which may lie outside of [0, size)
+ * @param size The number of rows or columns in the image
+ * @param mode The border mode
+ * @return The index inside the image, or -1 if the pixel is zero
+*/
+int border_index(const int& index, const int& size, const BorderMode& mode);
+
+
+/**
+ * Returns the number of color channels in a pixel: three for RGB and RGBA, one for
+ * gray and gray with alpha
+ * @param bpp Bytes per pixel
+ * @return The number of color channels
+*/
+inline int color_channels(const int& bpp) {
+ return bpp >= 3 ? 3 : 1;
+}
+
+
+/**
+ * Returns whether the last byte of a pixel is alpha: for gray with alpha and RGBA
+ * @param bpp Bytes per pixel
+ * @return Whether the pixel has an alpha channel
+*/
+inline bool has_alpha(const int& bpp) {
+ return bpp == 2 || bpp == 4;
+}
+
+
+/**
+ * Checks whether ImageMatrix::filter keeps a gray image gray, which it does if the matrix
+ * maps every gray value to the same value in all three channels; otherwise the output is RGB
+ * @param matrix Multiplies the rgb components by the first three rows and adds the last row
+ * @param sample_type The sample type of the image
+ * @return Whether the output of a gray image is gray
+*/
+bool filter_keeps_gray(const double* matrix, const SampleType& sample_type);
+
+
+/**
+ * Checks whether ImageMatrix::convolve runs a kernel on float planes rather than on 8-bit
+ * planes, which it does for samples wider than 8 bits and for images with alpha that an
+ * averaging kernel blurs in premultiplied alpha
+ * @param bpp Channels per pixel
+ * @param sample_type The sample type of the image
+ * @param kernel The kernel matrix
+ * @param kernel_size The length of the kernel array
+ * @param scalar A scalar by which to multiply the kernel
+ * @return Whether the kernel runs on float planes
+*/
+bool convolves_float_planes(const int& bpp, const SampleType& sample_type, const double* kernel,
+                            const size_t& kernel_size, const double& scalar);
+
+
+/**
+ * Copies the alpha channel of an image into an image of the same size and format
+ * @param source The image whose alpha is copied
+ * @param dest The image whose alpha is overridden
+*/
+void copy_alpha(const ImageMatrix& source, ImageMatrix& dest);
+
+
+/**
+ * Rounds a size up to the next multiple of ROW_ALIGNMENT
+ * @param size The size in bytes
+ * @return The aligned size
+*/
+inline size_t align_up(const size_t& size) {
+ return (size + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+}
+
+
+/**
+ * Clamps a channel value to the byte range and rounds it to the nearest integer
+ * @param value The channel value
+ * @return The byte value
+*/
+inline std::uint8_t clamp_round(const double& value) {
+ return static_cast<std::uint8_t>((value < 0.0 ? 0.0 : value > 255.0 ? 255.0 : value) + 0.5);
+}
+
+
+/**
+ * Converts a value to a sample, rounding and clamping it to the range of integer samples
+ * @param value The value, in units of the sample type
+ * @return The sample
+*/
+template <typename T> T to_sample(const double& value);
+
+template <> inline std::uint8_t to_sample<std::uint8_t>(const double& value) {
+ return clamp_round(value);
+}
+
+template <> inline std::uint16_t to_sample<std::uint16_t>(const double& value) {
+ return static_cast<std::uint16_t>((value < 0.0 ? 0.0 : value > 65535.0 ? 65535.0 : value) + 0.5);
+}
+
+template <> inline float to_sample<float>(const double& value) {
+ return static_cast<float>(value);
+}
+
+
+/**
+ * Allocates a zeroed block of memory aligned to ROW_ALIGNMENT bytes from the shared buffer
+ * pool, which reuses the blocks of images that were deleted
+ * @param size The size of the block in bytes
+ * @return The block, which must be released with free_aligned
+*/
+std::uint8_t* allocate_aligned(const size_t& size);
+
+
+/**
+ * Releases a block allocated with allocate_aligned
+ * @param data The block
+*/
+void free_aligned(std::uint8_t* data);
+
+
 /**
  * Reads an image
  * @param ref_path The path of the image
  * @param width A reference to be overridden with the image's width
  * @param height A reference to be overridden with the image's height
- * @param bpp A reference to be overridden with the number of bits per pixel
- * @return The image matrix that was read
+ * @param bpp A reference to be overridden with the number of channels per pixel
+ * @return The image matrix that was read, with 16-bit samples for 16-bit PNGs and PNMs and
+ * float samples for Radiance HDR files
 */
 ImageMatrix* read_image(const std::string& ref_path, int& width, int& height, int& bpp);
 
 
 /**
- * Writes an image
+ * Reads the format read_image would give an image from its header, without decoding it
+ * @param ref_path The path of the image
+ * @param bpp A reference to be overridden with the number of channels per pixel
+ * @param sample_type A reference to be overridden with the sample type
+*/
+void read_image_info(const std::string& ref_path, int& bpp, SampleType& sample_type);
+
+
+/**
+ * Writes an image. Float images keep their samples in .hdr files; every other format
+ * is written with 8-bit samples.
  * @param out_path The destination path for the new image
  * @param new_image The new image
 */
 void write_image(const std::string& out_path, const ImageMatrix& new_image);
 
 
+/**
+ * Writes an image. Float images keep their samples in .hdr files; every other format
+ * is written with 8-bit samples.
+ * @param out_path The destination path for the new image
+ * @param new_image The new image
+ * @param dithered Whether wider samples are dithered instead of rounded to 8 bits
+*/
+void write_image(const std::string& out_path, const ImageMatrix& new_image, const bool& dithered);
+
+
+/**
+ * Quantizes an image to 8-bit samples with an ordered dither, which turns the rounding
+ * error of wider samples into fine noise instead of bands in smooth gradients. Alpha is
+ * rounded.
+ * @param image The image
+ * @return The 8-bit image
+*/
+ImageMatrix* dither(const ImageMatrix& image);
+
+
+/**
+ * Quantizes an image that is a band of rows of a larger image to 8-bit samples with an
+ * ordered dither, giving the same samples as dithering the larger image
+ * @param image The band of rows
+ * @param first_row The row of the larger image that is the first row of the band
+ * @return The 8-bit image
+*/
+ImageMatrix* dither(const ImageMatrix& image, const int& first_row);
+
+
+/**
+ * Reads a text file
+ * @param path The path of the text file
+ * @return The contents of the file
+*/
+std::string read_textfile(const std::string& path);
+
+
 /**
  * Writes a text file
  * @param out_path The destination path for the text file